@@ -0,0 +1,30 @@
+#ifndef GBA_COLORBLEND
+#define GBA_COLORBLEND
+
+#include "types.hpp"
+
+// Color special effects applied to a whole line of RGB555 pixels at once.
+// Every pixel has its own effect, the coefficients are shared by the line and
+// must already be clamped to 16 like the hardware does.
+enum {
+	BLEND_NONE,
+	BLEND_ALPHA,
+	BLEND_BRIGHTEN,
+	BLEND_DARKEN
+};
+
+typedef void (*BlendLineFunction)(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy);
+
+// Reference implementation, the SIMD kernels have to match it bit for bit
+void blendLineScalar(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy);
+#if defined(__x86_64__) || defined(_M_X64)
+void blendLineSse2(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy);
+#if defined(__GNUC__)
+void blendLineAvx2(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy);
+#endif
+#endif
+
+// Fastest kernel the CPU supports
+extern BlendLineFunction blendLine;
+
+#endif
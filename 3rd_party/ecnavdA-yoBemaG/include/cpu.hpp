@@ -2,6 +2,7 @@
 #define GBA_CPU_HPP
 
 #include <atomic>
+#include <condition_variable>
 #include <cstdio>
 #include <mutex>
 #include <queue>
@@ -71,7 +72,9 @@ public:
 		LOAD_BIOS,
 		LOAD_ROM,
 		UPDATE_KEYINPUT,
-		CLEAR_LOG
+		CLEAR_LOG,
+		DEBUG_SNAPSHOT,
+		SET_BUS_STATS
 	};
 	struct threadEvent {
 		threadEventType type;
@@ -80,7 +83,13 @@ public:
 	};
 	std::queue<threadEvent> threadQueue;
 	std::mutex threadQueueMutex;
+	// Lets a paused thread sleep. Has its own lock so waking never waits for events being handled
+	std::mutex threadWakeMutex;
+	std::condition_variable threadWakeCondition;
+	bool threadWakeup;
 	void processThreadEvents();
+	void waitForThreadEvents();
+	void wakeThread();
 	void addThreadEvent(threadEventType type);
 	void addThreadEvent(threadEventType type, u64 intArg);
 	void addThreadEvent(threadEventType type, void *ptrArg);
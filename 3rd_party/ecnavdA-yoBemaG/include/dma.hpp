@@ -20,6 +20,7 @@ public:
 	void onFifoB();
 	void checkDma();
 	template <int channel> void doDma();
+	bool eepromDma(int length);
 	inline void dmaEnd();
 
     u8 readIO(u32 address);
@@ -48,6 +49,7 @@ public:
 		};
 		u32 raw;
 	};
+	bool rasterDma(u32 *sourceAddress, u32 *destinationAddress, DmaControlBits *control, u32 *openBus, int length);
 
 	u32 internalDMA0SAD;
 	u32 internalDMA0DAD;
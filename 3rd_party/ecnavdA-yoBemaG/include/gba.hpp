@@ -5,16 +5,20 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <iterator>
+#include <mutex>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <queue>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
 #include <thread>
 //#include <unistd.h>
 #include <vector>
@@ -26,6 +30,7 @@
 #include "apu.hpp"
 #include "dma.hpp"
 #include "ppu.hpp"
+#include "savememory.hpp"
 #include "timer.hpp"
 
 class GBACPU;
@@ -46,6 +51,7 @@ public:
 	int loadBios(std::filesystem::path biosFilePath_);
 	int loadRom(std::filesystem::path romFilePath_);
 	void save();
+	void flushSave();
 
 	u8 readDebug(u32 address);
 	template <typename T> T openBus(u32 address);
@@ -58,13 +64,69 @@ public:
 	bool forceNonSequential;
 	void internalCycle(int cycles);
 
+	// Bus statistics, only collected while busStatsEnabled is set
+	enum BusRegion {
+		BUS_BIOS,
+		BUS_EWRAM,
+		BUS_IWRAM,
+		BUS_IO,
+		BUS_PALETTE,
+		BUS_VRAM,
+		BUS_OAM,
+		BUS_ROM_WS0,
+		BUS_ROM_WS1,
+		BUS_ROM_WS2,
+		BUS_SRAM,
+		BUS_UNUSED,
+		BUS_INTERNAL,
+		BUS_REGION_COUNT
+	};
+	struct BusStats {
+		u64 accesses;
+		u64 bytes;
+		u64 cycles;
+		u64 prefetchSavedCycles;
+	};
+	static const char *busRegionNames[BUS_REGION_COUNT];
+	std::atomic<bool> busStatsEnabled; // Only changed on the emulator thread, see setBusStatsEnabled
+	BusStats busStats[BUS_REGION_COUNT];
+	BusStats busStatsLastFrame[BUS_REGION_COUNT];
+	u64 busStatsFrameStart;
+	u64 busStatsLastFrameCycles;
+	std::mutex busStatsMutex;
+	static int busRegion(u32 address) {
+		static constexpr u8 regions[16] = {
+			BUS_BIOS, BUS_UNUSED, BUS_EWRAM, BUS_IWRAM, BUS_IO, BUS_PALETTE, BUS_VRAM, BUS_OAM,
+			BUS_ROM_WS0, BUS_ROM_WS0, BUS_ROM_WS1, BUS_ROM_WS1, BUS_ROM_WS2, BUS_ROM_WS2, BUS_SRAM, BUS_SRAM
+		};
+		return (address < 0x10000000) ? regions[address >> 24] : static_cast<int>(BUS_UNUSED);
+	}
+	void countBusAccess(int region, int bytes) {
+		if (busStatsEnabled.load(std::memory_order_relaxed)) [[unlikely]] {
+			busStats[region].accesses++;
+			busStats[region].bytes += bytes;
+		}
+	}
+	void tickBus(int region, int cycles) {
+		if (busStatsEnabled.load(std::memory_order_relaxed)) [[unlikely]]
+			busStats[region].cycles += cycles;
+		cpu.tickScheduler(cycles);
+		prefetchClock += cycles;
+	}
+	void setBusStatsEnabled(bool enable);
+	void endBusStatsFrame();
+	std::string busStatsReport();
+
+	// The prefetch buffer is only modeled by the time it started filling. How many halfwords
+	// it holds is worked out from prefetchClock when the CPU fetches code from ROM. The clock
+	// only moves once a bus access or internal cycle has finished, time spent in the HLE BIOS
+	// or halted doesn't fill the buffer.
 	bool prefetchRunning;
-	int prefetchIndex;
 	int prefetchWaitstate;
-	int prefetchCycles;
-	int prefetchLastAddress;
-	void tickPrefetch(int cycles);
-	bool checkPrefetch(u32 address, bool sequential);
+	u64 prefetchClock;
+	u64 prefetchStartTime;
+	u32 prefetchLastAddress;
+	void stopPrefetch();
 
 	std::stringstream log;
 	bool logFlash;
@@ -77,6 +139,28 @@ public:
 		FLASH_128K
 	} saveType;
 	std::filesystem::path saveFilePath;
+
+	// Saves are written by a background thread. Writes to save memory mark which 4KB sectors
+	// changed, and the emulator thread copies those into saveSnapshot at VBlank and when it
+	// stops. The save thread only ever reads the snapshot. saveMutex covers the snapshot,
+	// the file itself is written under saveFileMutex.
+	static constexpr auto saveFlushInterval = std::chrono::seconds(1);
+	std::thread saveThread;
+	std::mutex saveMutex;
+	std::mutex saveFileMutex;
+	std::condition_variable saveCondition;
+	std::atomic<bool> saveRequested;
+	bool saveThreadExit;
+	std::atomic<u32> saveDirtySectors;
+	std::vector<u8> saveSnapshot;
+	u32 saveSnapshotDirty; // Sectors in the snapshot that aren't in the file yet
+	void takeSaveSnapshot(bool wait = false);
+	void saveThreadLoop();
+	void markSaveDirty(u32 offset, u32 size = 1) {
+		u32 first = offset >> 12;
+		u32 last = (offset + size - 1) >> 12;
+		saveDirtySectors.fetch_or(((2u << last) - 1) & ~((1u << first) - 1), std::memory_order_release);
+	}
 	enum {
 		READY = 1 << 0,
 		CMD_1 = 1 << 1,
@@ -88,6 +172,26 @@ public:
 	int flashState;
 	bool flashChipId;
 	int flashBank;
+	enum {
+		EEPROM_IDLE,
+		EEPROM_COMMAND,
+		EEPROM_ADDRESS,
+		EEPROM_DATA,
+		EEPROM_STOP,
+		EEPROM_READ
+	};
+	int eepromState;
+	bool eepromWriting;
+	bool eepromSizeKnown; // Size is decided by the first DMA when there is no save file, games that only use the CPU stay at 8K
+	int eepromBitCount;
+	u64 eepromBuffer;
+	u32 eepromAddress;
+	bool isEeprom(u32 address) {
+		return ((saveType == EEPROM_512B) || (saveType == EEPROM_8K)) && ((address >> 24) == 0x0D) && ((romSize <= 0x1000000) || (address >= 0x0DFFFF00));
+	}
+	void detectEepromSize(int length);
+	u16 readEeprom();
+	void writeEeprom(u16 value);
 
 	u32 biosOpenBusValue;
 	u32 openBusValue;
@@ -95,6 +199,7 @@ public:
 	u8 iwram[0x8000];
 	u16 KEYINPUT; // 0x4000130
 	u16 KEYCNT; // 0x4000132
+	void checkKeypadInterrupt();
 	bool POSTFLG; // 0x4000300
 
 	union {
@@ -132,7 +237,8 @@ public:
 	std::vector<u8> biosBuff;
 	int romSize;
 	std::vector<u8> romBuff;
-	std::vector<u8> sram;
+	SaveMemory sram;
+	bool mapSaveFile; // Back sram with a shared mapping of the save file instead of saving it
 };
 
 #endif
\ No newline at end of file
@@ -4,61 +4,22 @@
 
 #include <atomic>
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
 
 #include "types.hpp"
 
-class GameBoyAdvance;
-class GBAPPU {
+// Everything the renderer reads to draw a scanline. The PPU holds the live registers and
+// points at its own memory, and a copy is taken for every scanline that gets drawn.
+class GBAPPUState {
 public:
-	GameBoyAdvance& bus;
-
-	GBAPPU(GameBoyAdvance& bus_);
-	void reset();
-
-	static void lineStartEvent(void *object);
-	void lineStart();
-	static void hBlankEvent(void *object);
-	void hBlank();
-
-	void calculateWindow();
-	void addPixel(int x, u16 color, int layer, bool semiTransparent);
-	void drawObjects(int priority);
-	template <int mode, int size> int calculateTilemapIndex(int x, int y);
-	template <int bgNum> void drawBgTile();
-	template <int bgNum> void drawBgAffine();
-	template <int mode> void drawBgBitmap();
-	void drawScanline();
-
-	u8 readIO(u32 address);
-	void writeIO(u32 address, u8 value);
-
-	int frameCounter;
-	std::atomic<bool> updateScreen;
-	uint16_t framebuffer[160][240];
-
-	struct Pixel {
-		int layer;
-		u16 color;
-		u16 oldColor;
-		bool semiTransparent;
-	};
-	bool win0Buffer[240];
-	bool win1Buffer[240];
-	bool winObjBuffer[240];
-	bool winOutBuffer[240];
-	Pixel mergedBuffer[240];
-
-	// Internal registers
-	bool win0VertFits;
-	bool win1VertFits;
-	float internalBG2X;
-	float internalBG2Y;
-	float internalBG3X;
-	float internalBG3Y;
-
 	struct __attribute__ ((packed)) Object {
 		union {
 			struct {
@@ -107,16 +68,22 @@ public:
 		i16 pd;
 	};
 
-	union {
-		u8 paletteRam[0x400];
-		u16 paletteColors[0x200];
-	};
-	u8 vram[0x18000];
-	union {
-		u8 oam[0x400];
-		Object objects[128];
-		ObjectMatrix objectMatrices[32];
-	};
+
+	u8 *vram;
+	u16 *paletteColors;
+	Object *objects;
+	ObjectMatrix *objectMatrices;
+	u32 oamVersion; // Changes on every OAM write
+	u32 vramVersion[3]; // Same for BG tiles, bitmap/OBJ tiles and OBJ tiles
+	u32 paletteVersion[2]; // Same for BG and OBJ palettes
+
+	// Internal registers
+	bool win0VertFits;
+	bool win1VertFits;
+	i32 internalBG2X; // 20.8 fixed point like BG2X/BG2Y
+	i32 internalBG2Y;
+	i32 internalBG3X;
+	i32 internalBG3Y;
 
 	// MMIO
 	union {
@@ -341,9 +308,258 @@ public:
 		};
 		u16 BLDY; // 0x4000054
 	};
-	float evaCoefficientFloat;
-	float evbCoefficientFloat;
-	float evyCoefficientFloat;
 };
 
-#endif
\ No newline at end of file
+class GBAPPURenderer : public GBAPPUState {
+public:
+	void addWindowSpan(int start, int end, u8 mask);
+	void calculateWindow();
+	void buildObjectLists();
+	void drawObjects(bool window);
+	template <int mode, int size> int calculateTilemapIndex(int x, int y);
+	const u8 *tileRow(int address, bool bpp);
+	void invalidateTileRows(const u64 *dirtyBlocks);
+	template <int bgNum> void drawBgTile();
+	template <int bgNum> void drawBgAffine();
+	template <int mode> void drawBgBitmap();
+	template <int mode> void drawBgBitmapRow(int startX, int y);
+	void drawBg(int bg);
+	bool pixelsCovered(int start, int count);
+	void updateCoverage(int bg, const u64 *visiblePixels, const u64 *effectPixels);
+	void composite(u16 *line, const int *bgOrder, int bgCount);
+	void drawScanline(u16 *line);
+	void drawScanline(u32 *line);
+
+	// Every layer is drawn into its own line, then composite() merges them.
+	// Bit 15 is set for pixels that aren't transparent.
+	u16 bgLines[4][240];
+	u16 objLine[240];
+	u8 objLineInfo[240]; // Priority in bits 0-1, semi-transparent in bit 2
+
+	// Runs of pixels with the same window settings. The mask has layers in bits 0-4
+	// and color effects in bit 5, like WININ/WINOUT.
+	struct WindowSpan {
+		u8 start;
+		u8 end;
+		u8 mask;
+	};
+	WindowSpan windowSpans[240];
+	int windowSpanCount;
+	u8 objWindowLine[240];
+
+	// One bit per pixel. Backgrounds are drawn from the top down, and pixels where the
+	// layers above already decide the final color are skipped by the layers below.
+	u64 opaquePixels[4];
+	u64 coveredPixels[4];
+
+	// Decoded BG tile rows, indexed by the VRAM address of the row divided by its size.
+	// Validity is tracked per 32 bytes of VRAM, the same as GBAPPU::vramDirtyBlocks.
+	u8 tileRows4[0x10000 / 4][8];
+	u8 tileRows8[0x10000 / 8][8];
+	u64 tileRowsValid4[32];
+	u64 tileRowsValid8[32];
+
+	// Objects on each scanline, rebuilt whenever OAM changes
+	struct ObjectBounds {
+		unsigned int xSize;
+		unsigned int ySize;
+		unsigned int width; // Size on screen, double for affine double size objects
+		unsigned int height;
+		int tileBase; // Offset of the first tile in object VRAM
+	};
+	bool objectListsBuilt = false;
+	u32 objectListsVersion;
+	ObjectBounds objectBounds[128];
+	u8 lineObjects[160][128];
+	u8 lineObjectCount[160];
+	u8 lineWindowObjectCount[160];
+
+	u16 rgb555Line[240]; // Scanline before conversion when drawing RGBA8888
+
+	u16 blendTop[240];
+	u16 blendBottom[240];
+	u8 blendEffect[240];
+};
+
+class GameBoyAdvance;
+class GBAPPU : public GBAPPUState {
+public:
+	GameBoyAdvance& bus;
+
+	GBAPPU(GameBoyAdvance& bus_);
+	~GBAPPU();
+	void reset();
+
+	static void lineStartEvent(void *object);
+	void lineStart();
+	static void hBlankEvent(void *object);
+	void hBlank();
+	void drawScanline(const GBAPPUState& state);
+
+	// Catch-up rendering. Lines are only drawn once something they read is about to change,
+	// or at VBlank, so frames that don't change the PPU mid-frame are drawn all at once.
+	// The frontend sets catchUpRequested, which only takes effect at the start of a frame.
+	struct PendingLine {
+		bool win0VertFits;
+		bool win1VertFits;
+		i32 internalBG2X;
+		i32 internalBG2Y;
+		i32 internalBG3X;
+		i32 internalBG3Y;
+	};
+	std::atomic<bool> catchUpRequested;
+	bool catchUpRendering;
+	PendingLine pendingLines[160];
+	int pendingLineFirst;
+	int pendingLineCount;
+	void drawPendingLines();
+	void catchUp() {
+		if (pendingLineCount)
+			drawPendingLines();
+	}
+
+	u8 readIO(u32 address);
+	void writeIO(u32 address, u8 value);
+
+	int frameCounter;
+
+	// The screen is drawn into one of the framebuffers, picked by outputFormat
+	enum OutputFormat {
+		OUTPUT_RGB555,
+		OUTPUT_RGBA8888
+	};
+	OutputFormat outputFormat;
+	uint16_t framebuffer[160][240];
+	u32 framebufferRgba[160][240];
+	static const std::array<u32, 0x8000> rgba8888Lut;
+
+	// Finished frames are handed to the frontend through three RGBA8888 buffers, so neither
+	// side ever waits for the other. At VBlank the frame is copied into the back buffer, which
+	// is then swapped with the ready one. The frontend swaps the ready buffer with the one it
+	// shows when there is a new frame, and frames it never took are simply overwritten.
+	u32 presentBuffers[3][160][240];
+	std::atomic<u8> readyBuffer; // Index in bits 0-1, bit 2 is set when it holds a new frame
+	int backBuffer;
+	int frontBuffer;
+	void publishFrame();
+	const u32 *takeFrame();
+
+	// Lets the frontend sleep until there is something new to show instead of redrawing constantly
+	std::mutex presentMutex;
+	std::condition_variable presentCondition;
+	bool presenterWakeup;
+	bool waitForFrame(std::chrono::steady_clock::time_point deadline);
+	void wakePresenter();
+
+	// Frameskip. Skipped frames keep all of the PPU's timing, IRQs, DMA and affine
+	// register updates, only the pixels aren't drawn and the screen isn't updated.
+	// In auto mode the amount follows how long the host takes to emulate a frame.
+	static constexpr int maxFrameskip = 9;
+	static constexpr auto gbaFrameTime = std::chrono::nanoseconds(16742706); // 280896 cycles at 16.78MHz
+	int frameskip;
+	bool autoFrameskip;
+	int autoFrameskipAmount;
+	int skippedFrames;
+	bool skipCurrentFrame;
+	std::chrono::steady_clock::time_point lastFrameStart;
+	void startFrame();
+
+	union {
+		u8 paletteRam[0x400];
+		u16 paletteRamColors[0x200];
+	};
+	u32 paletteRgba[0x200]; // Palette RAM converted to RGBA8888 for the debug views
+	u8 vramData[0x18000];
+	union {
+		u8 oam[0x400];
+		Object oamObjects[128];
+	};
+
+	// Scanlines can be drawn on a separate thread. Every scanline gets a copy of the
+	// registers, and VRAM/palette/OAM are copied only when they were written since the
+	// last scanline, so lines can share the same copy. The frontend sets renderThreadRequested,
+	// which only takes effect at the start of a frame.
+	std::atomic<bool> renderThreadRequested;
+	bool renderThreadEnabled;
+	GBAPPURenderer renderer;
+	GBAPPURenderer threadRenderer;
+	bool vramDirty;
+	u64 vramDirtyBlocks[32]; // BG tile data written since the last scanline, one bit per 32 bytes
+	bool renderedOnThread;
+	void markVramDirty(u32 offset) {
+		vramDirty = true;
+		if (offset < 0x10000) {
+			vramDirtyBlocks[offset >> 11] |= 1ULL << ((offset >> 5) & 63);
+			vramVersion[0]++;
+		} else {
+			vramVersion[(offset < 0x14000) ? 1 : 2]++;
+		}
+	}
+	bool paletteDirty;
+	void markPaletteDirty(u32 offset) {
+		paletteDirty = true;
+		paletteVersion[offset >> 9]++;
+
+		int entry = (offset >> 1) & ~1; // Word writes change two colors
+		paletteRgba[entry] = rgba8888Lut[paletteRamColors[entry] & 0x7FFF];
+		paletteRgba[entry + 1] = rgba8888Lut[paletteRamColors[entry + 1] & 0x7FFF];
+	}
+	bool oamDirty;
+	std::shared_ptr<u8[]> vramCopy;
+	std::shared_ptr<u8[]> paletteCopy;
+	std::shared_ptr<u8[]> oamCopy;
+	struct ScanlineJob {
+		GBAPPUState state;
+		OutputFormat outputFormat;
+		u64 vramDirtyBlocks[32];
+		std::shared_ptr<u8[]> vram;
+		std::shared_ptr<u8[]> palette;
+		std::shared_ptr<u8[]> oam;
+	};
+
+	// Scanlines can be reused from the last frame when nothing they read has changed since.
+	// The signature holds every register the renderer reads and the versions of the memory it reads.
+	// The frontend sets lineReuseRequested, which only takes effect at the start of a frame.
+	struct LineSignature {
+		u32 values[40];
+
+		bool operator==(const LineSignature& other) const {
+			return !memcmp(values, other.values, sizeof(values));
+		}
+	};
+	std::atomic<bool> lineReuseRequested;
+	bool lineReuseEnabled;
+	LineSignature lineSignatures[160];
+	bool lineSignaturesValid[160];
+	std::atomic<u64> lineReuseHits;
+	std::atomic<u64> lineReuseMisses;
+	static void makeLineSignature(LineSignature& signature, const GBAPPUState& state, OutputFormat format);
+	void drawLine(GBAPPURenderer& lineRenderer, OutputFormat format);
+
+	// The frontend's debug views draw from a copy of VRAM, palette and registers taken on the
+	// emulator thread, so they never see a half written frame. The copy and its generation are
+	// only updated when something the views show has changed.
+	struct DebugSnapshot {
+		GBAPPUState state;
+		u8 vram[0x18000];
+		u32 paletteRgba[0x200];
+	};
+	DebugSnapshot debugSnapshot;
+	std::mutex debugSnapshotMutex;
+	std::atomic<u64> debugSnapshotGeneration;
+	std::atomic<bool> debugSnapshotRequested;
+	void requestDebugSnapshot();
+	void takeDebugSnapshot();
+
+	std::thread renderThread;
+	std::mutex renderQueueMutex;
+	std::condition_variable renderQueueCondition;
+	std::condition_variable renderDoneCondition;
+	std::queue<ScanlineJob> renderQueue;
+	int renderPendingLines;
+	bool renderThreadExit;
+	void renderThreadLoop();
+	void waitForRenderThread();
+};
+
+#endif
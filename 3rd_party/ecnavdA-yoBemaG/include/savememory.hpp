@@ -0,0 +1,41 @@
+#ifndef GBA_SAVEMEMORY
+#define GBA_SAVEMEMORY
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+#include "types.hpp"
+
+// Backing storage for SRAM/Flash/EEPROM. Normally a plain buffer, but it can also be
+// a shared mapping of the save file so that writes reach the file without a save step.
+class SaveMemory {
+public:
+	SaveMemory();
+	~SaveMemory();
+	SaveMemory(const SaveMemory&) = delete; // Owns the mapping and file descriptor
+	SaveMemory& operator=(const SaveMemory&) = delete;
+
+	u8& operator[](size_t index) { return buffer[index]; }
+	const u8& operator[](size_t index) const { return buffer[index]; }
+	u8 *data() { return buffer; }
+	const u8 *data() const { return buffer; }
+	size_t size() const { return bufferSize; }
+	bool mapped() const { return mappedSize != 0; }
+
+	void resize(size_t newSize);
+	bool map(std::filesystem::path filePath, size_t newSize);
+	void unmap();
+	void sync();
+
+private:
+	u8 *buffer;
+	size_t bufferSize;
+	std::vector<u8> storage;
+
+	int fileDescriptor;
+	size_t mappedSize;
+	std::filesystem::path mappedFilePath;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "colorblend.hpp"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+static inline u16 blendPixel(u16 top, u16 bottom, int effect, int eva, int evb, int evy) {
+	int red = top & 0x1F;
+	int green = (top >> 5) & 0x1F;
+	int blue = (top >> 10) & 0x1F;
+
+	switch (effect) {
+	case BLEND_ALPHA:
+		red = std::min(31, ((red * eva) + ((bottom & 0x1F) * evb)) >> 4);
+		green = std::min(31, ((green * eva) + (((bottom >> 5) & 0x1F) * evb)) >> 4);
+		blue = std::min(31, ((blue * eva) + (((bottom >> 10) & 0x1F) * evb)) >> 4);
+		break;
+	case BLEND_BRIGHTEN:
+		red += ((31 - red) * evy) >> 4;
+		green += ((31 - green) * evy) >> 4;
+		blue += ((31 - blue) * evy) >> 4;
+		break;
+	case BLEND_DARKEN:
+		red -= (red * evy) >> 4;
+		green -= (green * evy) >> 4;
+		blue -= (blue * evy) >> 4;
+		break;
+	default:
+		return top & 0x7FFF;
+	}
+
+	return red | (green << 5) | (blue << 10);
+}
+
+void blendLineScalar(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy) {
+	for (int i = 0; i < count; i++)
+		out[i] = blendPixel(top[i], bottom[i], effect[i], eva, evb, evy);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+static inline __m128i selectLanes(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Channels never go above 31 * 16 * 2 before the shift, so 16 bit lanes are enough
+void blendLineSse2(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy) {
+	const __m128i channelMask = _mm_set1_epi16(0x1F);
+	const __m128i maxChannel = _mm_set1_epi16(31);
+	const __m128i evaVec = _mm_set1_epi16(eva);
+	const __m128i evbVec = _mm_set1_epi16(evb);
+	const __m128i evyVec = _mm_set1_epi16(evy);
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; (i + 8) <= count; i += 8) {
+		__m128i topColor = _mm_loadu_si128((const __m128i *)(top + i));
+		__m128i bottomColor = _mm_loadu_si128((const __m128i *)(bottom + i));
+		__m128i effects = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(effect + i)), zero);
+
+		__m128i result = _mm_and_si128(topColor, _mm_set1_epi16(0x7FFF));
+		for (int shift = 0; shift < 15; shift += 5) {
+			__m128i a = _mm_and_si128(_mm_srli_epi16(topColor, shift), channelMask);
+			__m128i b = _mm_and_si128(_mm_srli_epi16(bottomColor, shift), channelMask);
+
+			__m128i alpha = _mm_min_epi16(_mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, evaVec), _mm_mullo_epi16(b, evbVec)), 4), maxChannel);
+			__m128i brighten = _mm_add_epi16(a, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(maxChannel, a), evyVec), 4));
+			__m128i darken = _mm_sub_epi16(a, _mm_srli_epi16(_mm_mullo_epi16(a, evyVec), 4));
+
+			__m128i channel = selectLanes(_mm_cmpeq_epi16(effects, _mm_set1_epi16(BLEND_ALPHA)), alpha, a);
+			channel = selectLanes(_mm_cmpeq_epi16(effects, _mm_set1_epi16(BLEND_BRIGHTEN)), brighten, channel);
+			channel = selectLanes(_mm_cmpeq_epi16(effects, _mm_set1_epi16(BLEND_DARKEN)), darken, channel);
+			result = _mm_or_si128(_mm_andnot_si128(_mm_slli_epi16(channelMask, shift), result), _mm_slli_epi16(channel, shift));
+		}
+
+		_mm_storeu_si128((__m128i *)(out + i), result);
+	}
+
+	blendLineScalar(out + i, top + i, bottom + i, effect + i, count - i, eva, evb, evy);
+}
+
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+void blendLineAvx2(u16 *out, const u16 *top, const u16 *bottom, const u8 *effect, int count, int eva, int evb, int evy) {
+	const __m256i channelMask = _mm256_set1_epi16(0x1F);
+	const __m256i maxChannel = _mm256_set1_epi16(31);
+	const __m256i evaVec = _mm256_set1_epi16(eva);
+	const __m256i evbVec = _mm256_set1_epi16(evb);
+	const __m256i evyVec = _mm256_set1_epi16(evy);
+
+	int i = 0;
+	for (; (i + 16) <= count; i += 16) {
+		__m256i topColor = _mm256_loadu_si256((const __m256i *)(top + i));
+		__m256i bottomColor = _mm256_loadu_si256((const __m256i *)(bottom + i));
+		__m256i effects = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(effect + i)));
+
+		__m256i result = _mm256_and_si256(topColor, _mm256_set1_epi16(0x7FFF));
+		for (int shift = 0; shift < 15; shift += 5) {
+			__m256i a = _mm256_and_si256(_mm256_srli_epi16(topColor, shift), channelMask);
+			__m256i b = _mm256_and_si256(_mm256_srli_epi16(bottomColor, shift), channelMask);
+
+			__m256i alpha = _mm256_min_epi16(_mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, evaVec), _mm256_mullo_epi16(b, evbVec)), 4), maxChannel);
+			__m256i brighten = _mm256_add_epi16(a, _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(maxChannel, a), evyVec), 4));
+			__m256i darken = _mm256_sub_epi16(a, _mm256_srli_epi16(_mm256_mullo_epi16(a, evyVec), 4));
+
+			__m256i channel = _mm256_blendv_epi8(a, alpha, _mm256_cmpeq_epi16(effects, _mm256_set1_epi16(BLEND_ALPHA)));
+			channel = _mm256_blendv_epi8(channel, brighten, _mm256_cmpeq_epi16(effects, _mm256_set1_epi16(BLEND_BRIGHTEN)));
+			channel = _mm256_blendv_epi8(channel, darken, _mm256_cmpeq_epi16(effects, _mm256_set1_epi16(BLEND_DARKEN)));
+			result = _mm256_or_si256(_mm256_andnot_si256(_mm256_slli_epi16(channelMask, shift), result), _mm256_slli_epi16(channel, shift));
+		}
+
+		_mm256_storeu_si256((__m256i *)(out + i), result);
+	}
+
+	blendLineSse2(out + i, top + i, bottom + i, effect + i, count - i, eva, evb, evy);
+}
+#endif
+#endif
+
+static BlendLineFunction pickBlendLine() {
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return blendLineAvx2;
+#endif
+	return blendLineSse2;
+#else
+	return blendLineScalar;
+#endif
+}
+
+BlendLineFunction blendLine = pickBlendLine();
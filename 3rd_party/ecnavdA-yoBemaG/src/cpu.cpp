@@ -13,6 +13,7 @@ GBACPU::GBACPU(GameBoyAdvance& bus_) : ARM7TDMI(bus_), bios(*this) {
 	traceInstructions = false;
 	logInterrupts = false;
 	uncapFps = false;
+	threadWakeup = false;
 
 	currentTime = 0;
 	eventQueue = {};
@@ -37,8 +38,11 @@ void GBACPU::reset() { // Should only be run once rom is loaded and system is re
 
 void GBACPU::run() { // Emulator thread is run from here
 	while (1) {
-		while (!running)
+		// STOP only ends with an interrupt, which has to come from a keypress
+		while (!running || stopped) {
+			waitForThreadEvents();
 			processThreadEvents();
+		}
 
 		if (!halted) {
 			//printf("r0:0x%08X r1:0x%08X r2:0x%08X r3:0x%08X r4:0x%08X r5:0x%08X r6:0x%08X r7:0x%08X r8:0x%08X r9:0x%08X r10:0x%08X r11:0x%08X r12:0x%08X r13:0x%08X r14:0x%08X r15:0x%08X cpsr:0x%08X\n", reg.R[0], reg.R[1], reg.R[2], reg.R[3], reg.R[4], reg.R[5], reg.R[6], reg.R[7], reg.R[8], reg.R[9], reg.R[10], reg.R[11], reg.R[12], reg.R[13], reg.R[14], reg.R[15], reg.CPSR);
@@ -92,9 +96,12 @@ void GBACPU::tickScheduler(int cycles) {
 			(*callback)(userData);
 
 			if (important) { [[unlikely]]
-				do {
+				while (true) {
 					processThreadEvents();
-				} while (!(running && (!bus.apu.apuBlock || uncapFps) && !stopped));
+					if (running && (!bus.apu.apuBlock || uncapFps) && !stopped)
+						break;
+					waitForThreadEvents(); // The audio callback wakes us once it has taken the samples
+				}
 			}
 		}
 	}
@@ -143,6 +150,7 @@ void GBACPU::requestInterrupt(irqType bit) {
 
 // Thread queue
 void GBACPU::processThreadEvents() {
+	bool debugSnapshot = false;
 	threadQueueMutex.lock();
 	while (!threadQueue.empty()) {
 		threadEvent currentEvent = threadQueue.front();
@@ -153,7 +161,12 @@ void GBACPU::processThreadEvents() {
 			running = true;
 			break;
 		case STOP:
-			addEvent(currentEvent.intArg, stopEvent, this);
+			if (stopped) { // The scheduler doesn't run in STOP mode
+				running = false;
+				bus.takeSaveSnapshot(true);
+			} else {
+				addEvent(currentEvent.intArg, stopEvent, this);
+			}
 			break;
 		case RESET:
 			bus.reset();
@@ -175,16 +188,41 @@ void GBACPU::processThreadEvents() {
 			break;
 		case UPDATE_KEYINPUT:
 			bus.KEYINPUT = currentEvent.intArg & 0x3FF;
+			bus.checkKeypadInterrupt();
 			break;
 		case CLEAR_LOG:
 			bus.log.str("");
 			break;
+		case DEBUG_SNAPSHOT: // Copied after the queue is unlocked so the UI isn't held up
+			debugSnapshot = true;
+			break;
+		case SET_BUS_STATS:
+			bus.setBusStatsEnabled(currentEvent.intArg);
+			break;
 		default:
 			printf("Unknown thread event:  %d\n", currentEvent.type);
 			break;
 		}
 	}
 	threadQueueMutex.unlock();
+
+	if (debugSnapshot)
+		bus.ppu.takeDebugSnapshot();
+}
+
+// Sleeps until an event is added or wakeThread is called. Every event sets the flag after it
+// is queued and the queue is only drained after waiting, so none can be missed.
+void GBACPU::waitForThreadEvents() {
+	std::unique_lock<std::mutex> lock(threadWakeMutex);
+	threadWakeCondition.wait(lock, [&]{ return threadWakeup; });
+	threadWakeup = false;
+}
+
+void GBACPU::wakeThread() {
+	threadWakeMutex.lock();
+	threadWakeup = true;
+	threadWakeMutex.unlock();
+	threadWakeCondition.notify_one();
 }
 
 void GBACPU::addThreadEvent(threadEventType type) {
@@ -203,8 +241,11 @@ void GBACPU::addThreadEvent(threadEventType type, u64 intArg, void *ptrArg) {
 	threadQueueMutex.lock();
 	threadQueue.push(GBACPU::threadEvent{type, intArg, ptrArg});
 	threadQueueMutex.unlock();
+	wakeThread();
 }
 
 void GBACPU::stopEvent(void *object) {
-	static_cast<GBACPU *>(object)->running = false;
+	GBACPU *cpu = static_cast<GBACPU *>(object);
+	cpu->running = false;
+	cpu->bus.takeSaveSnapshot(true);
 }
\ No newline at end of file
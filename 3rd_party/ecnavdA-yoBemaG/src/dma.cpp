@@ -4,6 +4,7 @@
 #include "types.hpp"
 #include "gba.hpp"
 #include <cstdio>
+#include <cstring>
 
 GBADMA::GBADMA(GameBoyAdvance& bus_) : bus(bus_) {
 	logDma = false;
@@ -172,7 +173,11 @@ void GBADMA::doDma() {
 	}
 
 	bool hasTransferred = false;
-	if (control->transferSize) { // 32 bit
+	if ((channel == 3) && eepromDma(length)) [[unlikely]] {
+		// Whole EEPROM request was handled at once
+	} else if ((control->timing == 2) && rasterDma(sourceAddress, destinationAddress, control, openBus, length)) {
+		// Raster effect was written straight to the PPU registers
+	} else if (control->transferSize) { // 32 bit
 		for (int i = 0; i < length; i++) {
 			if (*sourceAddress < 0x2000000) {
 				bus.write<u32>(*destinationAddress & ~3, *openBus, hasTransferred);
@@ -234,6 +239,168 @@ void GBADMA::doDma() {
 	//bus.cpu.tickScheduler(1);
 }
 
+// EEPROM is accessed one bit per halfword, so games use DMA3 for every request.
+// Transfers between RAM and EEPROM are done here directly instead of going through the bus.
+bool GBADMA::eepromDma(int length) {
+	bool toEeprom = bus.isEeprom(internalDMA3DAD);
+	if (!toEeprom && !bus.isEeprom(internalDMA3SAD))
+		return false;
+	if (toEeprom)
+		bus.detectEepromSize(length);
+
+	u32 ramAddress = toEeprom ? internalDMA3SAD : internalDMA3DAD;
+	int ramControl = toEeprom ? internalDMA3CNT.srcControl : internalDMA3CNT.dstControl;
+	int eepromControl = toEeprom ? internalDMA3CNT.dstControl : internalDMA3CNT.srcControl;
+	u8 *ram;
+	u32 ramMask;
+	int ramCycles;
+	int ramRegion = GameBoyAdvance::busRegion(ramAddress);
+	switch (ramAddress >> 24) {
+	case 0x02:
+		ram = bus.ewram;
+		ramMask = 0x3FFFE;
+		ramCycles = bus.ewramCycles;
+		break;
+	case 0x03:
+		ram = bus.iwram;
+		ramMask = 0x7FFE;
+		ramCycles = 1;
+		break;
+	default:
+		return false;
+	}
+	if (internalDMA3CNT.transferSize || (ramControl == 3))
+		return false;
+
+	int step = 0;
+	if (ramControl == 0) { // Increment
+		step = 2;
+	} else if (ramControl == 1) { // Decrement
+		step = -2;
+	}
+
+	u16 data = 0;
+	for (int i = 0; i < length; i++) {
+		if (toEeprom) {
+			std::memcpy(&data, ram + (ramAddress & ramMask), 2);
+			bus.writeEeprom(data);
+		} else {
+			data = bus.readEeprom();
+			std::memcpy(ram + (ramAddress & ramMask), &data, 2);
+		}
+
+		ramAddress += step;
+	}
+	dma3OpenBus = (data << 16) | data;
+
+	// The EEPROM side moves the same way as it would on the bus
+	int eepromStep = 0;
+	if ((eepromControl == 0) || (toEeprom && (eepromControl == 3))) { // Increment
+		eepromStep = 2;
+	} else if (eepromControl == 1) { // Decrement
+		eepromStep = -2;
+	}
+	if (toEeprom) {
+		internalDMA3SAD = ramAddress;
+		internalDMA3DAD += eepromStep * length;
+	} else {
+		internalDMA3DAD = ramAddress;
+		internalDMA3SAD += eepromStep * length;
+	}
+
+	// Same timing as doing each access on the bus
+	int romCycles = bus.wsNonSequentialCycles[2] + ((length - 1) * bus.wsSequentialCycles[2]);
+	if (bus.busStatsEnabled.load(std::memory_order_relaxed)) [[unlikely]] {
+		bus.busStats[ramRegion].accesses += length;
+		bus.busStats[ramRegion].bytes += length * 2;
+		bus.busStats[ramRegion].cycles += length * ramCycles;
+		bus.busStats[GameBoyAdvance::BUS_ROM_WS2].accesses += length;
+		bus.busStats[GameBoyAdvance::BUS_ROM_WS2].bytes += length * 2;
+		bus.busStats[GameBoyAdvance::BUS_ROM_WS2].cycles += romCycles;
+	}
+	bus.stopPrefetch();
+	bus.cpu.tickScheduler((length * ramCycles) + romCycles);
+	return true;
+}
+
+// Games do raster effects with HBlank DMA from a table in RAM into a few PPU registers every line.
+// When no event can happen during the transfer, the values are copied straight into the PPU
+// registers and the time is added at the end, which leaves the same state as going through the bus.
+bool GBADMA::rasterDma(u32 *sourceAddress, u32 *destinationAddress, DmaControlBits *control, u32 *openBus, int length) {
+	int unitSize = control->transferSize ? 4 : 2;
+	u32 source = *sourceAddress & ~(unitSize - 1);
+	u32 destination = *destinationAddress & ~(unitSize - 1);
+
+	int sourceStep = 0;
+	if (control->srcControl == 0) { // Increment
+		sourceStep = unitSize;
+	} else if (control->srcControl == 1) { // Decrement
+		sourceStep = -unitSize;
+	}
+	int destinationStep = 0;
+	if ((control->dstControl == 0) || (control->dstControl == 3)) { // Increment
+		destinationStep = unitSize;
+	} else if (control->dstControl == 1) { // Decrement
+		destinationStep = -unitSize;
+	}
+
+	// Only PPU registers, they have no side effects outside of the PPU
+	u32 destinationEnd = destination + (destinationStep * (length - 1));
+	if ((std::min(destination, destinationEnd) < 0x4000000) || ((std::max(destination, destinationEnd) + unitSize) > 0x4000056))
+		return false;
+
+	u8 *ram;
+	u32 ramMask;
+	int readCycles;
+	int ramRegion = GameBoyAdvance::busRegion(source);
+	switch (source >> 24) {
+	case 0x02:
+		ram = bus.ewram;
+		ramMask = 0x3FFFF;
+		readCycles = bus.ewramCycles * (unitSize / 2);
+		break;
+	case 0x03:
+		ram = bus.iwram;
+		ramMask = 0x7FFF;
+		readCycles = 1;
+		break;
+	default:
+		return false;
+	}
+	if (((source + (sourceStep * (length - 1))) >> 24) != (source >> 24))
+		return false;
+
+	int cycles = length * (readCycles + 1);
+	if (bus.cpu.eventQueue.top().timeStamp < (bus.cpu.currentTime + cycles))
+		return false;
+
+	u32 data = 0;
+	for (int i = 0; i < length; i++) {
+		std::memcpy(&data, ram + (source & ramMask), unitSize);
+		for (int byte = 0; byte < unitSize; byte++)
+			bus.ppu.writeIO(destination + byte, (u8)(data >> (byte * 8)));
+
+		source += sourceStep;
+		destination += destinationStep;
+	}
+	*openBus = (unitSize == 4) ? data : ((data << 16) | data);
+	*sourceAddress += sourceStep * length;
+	*destinationAddress += destinationStep * length;
+
+	if (bus.busStatsEnabled.load(std::memory_order_relaxed)) [[unlikely]] {
+		bus.busStats[ramRegion].accesses += length;
+		bus.busStats[ramRegion].bytes += length * unitSize;
+		bus.busStats[ramRegion].cycles += length * readCycles;
+		bus.busStats[GameBoyAdvance::BUS_IO].accesses += length;
+		bus.busStats[GameBoyAdvance::BUS_IO].bytes += length * unitSize;
+		bus.busStats[GameBoyAdvance::BUS_IO].cycles += length;
+	}
+	bus.forceNonSequential = false;
+	bus.cpu.tickScheduler(cycles);
+	bus.prefetchClock += cycles;
+	return true;
+}
+
 void GBADMA::dmaEnd() {
 	switch (currentDma) {
 	case 0:
@@ -6,12 +6,27 @@
 
 GameBoyAdvance::GameBoyAdvance() : cpu(*this), apu(*this), dma(*this), ppu(*this), timer(*this) {
 	logFlash = false;
+	mapSaveFile = false;
+	busStatsEnabled = false;
+
+	saveRequested = false;
+	saveThreadExit = false;
+	saveDirtySectors = 0;
+	saveSnapshotDirty = 0;
+	saveThread = std::thread(&GameBoyAdvance::saveThreadLoop, this);
 
 	//reset();
 }
 
 GameBoyAdvance::~GameBoyAdvance() {
-	save();
+	{
+		std::lock_guard<std::mutex> lock(saveMutex);
+		saveThreadExit = true;
+	}
+	saveCondition.notify_one();
+	saveThread.join();
+
+	flushSave();
 }
 
 void GameBoyAdvance::reset() {
@@ -21,6 +36,11 @@ void GameBoyAdvance::reset() {
 	flashState = READY;
 	flashChipId = false;
 	flashBank = 0;
+	eepromState = EEPROM_IDLE;
+	eepromWriting = false;
+	eepromBitCount = 0;
+	eepromBuffer = 0;
+	eepromAddress = 0;
 
 	memset(ewram, 0, sizeof(ewram));
 	memset(iwram, 0, sizeof(iwram));
@@ -39,6 +59,18 @@ void GameBoyAdvance::reset() {
 	InternalMemoryControl = 0x0D000000;
 	ewramCycles = 3;
 
+	memset(busStats, 0, sizeof(busStats));
+	memset(busStatsLastFrame, 0, sizeof(busStatsLastFrame));
+	busStatsFrameStart = 0;
+	busStatsLastFrameCycles = 0;
+
+	forceNonSequential = false;
+	prefetchRunning = false;
+	prefetchWaitstate = 0;
+	prefetchClock = 0;
+	prefetchStartTime = 0;
+	prefetchLastAddress = 0;
+
 	cpu.currentTime = 0;
 	cpu.eventQueue = {};
 
@@ -114,6 +146,11 @@ int GameBoyAdvance::loadRom(std::filesystem::path romFilePath_) {
 		romBuff[i + 1] = ((i / 2) >> 8) & 0xFF;
 	}
 
+	// Write out the previous game's save before replacing it
+	takeSaveSnapshot(true);
+	flushSave();
+	std::lock_guard<std::mutex> lock(saveMutex);
+
 	// Open save file
 	saveFilePath = romFilePath_;
 	saveFilePath.replace_extension(".sav");
@@ -122,6 +159,7 @@ int GameBoyAdvance::loadRom(std::filesystem::path romFilePath_) {
 	saveFileStream.seekg(0, std::ios::beg);
 
 	// Get save type/size
+	sram.unmap();
 	saveType = SRAM_32K;
 	sram.resize(32 * 1024);
 	char eeprom8KStr[] = "EEPROM_V";
@@ -150,21 +188,203 @@ int GameBoyAdvance::loadRom(std::filesystem::path romFilePath_) {
 		sram.resize(128 * 1024);
 	}
 
-	saveFileStream.read(reinterpret_cast<char*>(sram.data()), sram.size());
+	eepromSizeKnown = saveType != EEPROM_8K;
+	if ((saveType == EEPROM_8K) && std::filesystem::exists(saveFilePath)) {
+		if (std::filesystem::file_size(saveFilePath) == 512) {
+			saveType = EEPROM_512B;
+			sram.resize(512);
+		}
+		eepromSizeKnown = true;
+	}
+
+	if (mapSaveFile && sram.map(saveFilePath, sram.size())) {
+		log << "Mapped save file " << saveFilePath << "\n";
+	} else {
+		saveFileStream.read(reinterpret_cast<char*>(sram.data()), sram.size());
+	}
 	saveFileStream.close();
 
+	saveSnapshot.assign(sram.data(), sram.data() + sram.size());
+	saveDirtySectors = 0;
+	saveSnapshotDirty = 0;
+
 	return 0;
 }
 
+void GameBoyAdvance::detectEepromSize(int length) {
+	if (eepromSizeKnown)
+		return;
+
+	std::lock_guard<std::mutex> lock(saveMutex);
+
+	// Read requests are 9/17 bits long and writes are 73/81 bits long
+	if ((length == 9) || (length == 73)) {
+		saveType = EEPROM_512B;
+		sram.resize(512);
+		eepromSizeKnown = true;
+	} else if ((length == 17) || (length == 81)) {
+		saveType = EEPROM_8K;
+		sram.resize(8 * 1024);
+		eepromSizeKnown = true;
+	}
+
+	if (eepromSizeKnown) {
+		saveSnapshot.resize(sram.size());
+		log << "EEPROM size detected as " << sram.size() << " bytes\n";
+	}
+}
+
+u16 GameBoyAdvance::readEeprom() {
+	if (eepromState != EEPROM_READ)
+		return 1; // Ready
+
+	// 4 junk bits followed by 64 data bits
+	u16 bit = 0;
+	if (eepromBitCount >= 4) {
+		int dataBit = eepromBitCount - 4;
+		bit = (sram[eepromAddress + (dataBit >> 3)] >> (7 - (dataBit & 7))) & 1;
+	}
+
+	if (++eepromBitCount == 68)
+		eepromState = EEPROM_IDLE;
+	return bit;
+}
+
+void GameBoyAdvance::writeEeprom(u16 value) {
+	bool bit = value & 1;
+
+	switch (eepromState) {
+	case EEPROM_IDLE:
+	case EEPROM_READ:
+		if (bit)
+			eepromState = EEPROM_COMMAND;
+		break;
+	case EEPROM_COMMAND:
+		eepromWriting = !bit;
+		eepromState = EEPROM_ADDRESS;
+		eepromBitCount = 0;
+		eepromBuffer = 0;
+		break;
+	case EEPROM_ADDRESS:
+		eepromBuffer = (eepromBuffer << 1) | bit;
+
+		if (++eepromBitCount == ((saveType == EEPROM_512B) ? 6 : 14)) {
+			eepromAddress = (eepromBuffer & ((saveType == EEPROM_512B) ? 0x3F : 0x3FF)) << 3;
+			eepromState = eepromWriting ? EEPROM_DATA : EEPROM_STOP;
+			eepromBitCount = 0;
+			eepromBuffer = 0;
+		}
+		break;
+	case EEPROM_DATA:
+		eepromBuffer = (eepromBuffer << 1) | bit;
+
+		if (++eepromBitCount == 64)
+			eepromState = EEPROM_STOP;
+		break;
+	case EEPROM_STOP:
+		if (eepromWriting) {
+			for (int i = 0; i < 8; i++)
+				sram[eepromAddress + i] = (u8)(eepromBuffer >> (56 - (i * 8)));
+			markSaveDirty(eepromAddress);
+
+			eepromState = EEPROM_IDLE;
+		} else {
+			eepromState = EEPROM_READ;
+			eepromBitCount = 0;
+		}
+		break;
+	}
+}
+
+// Only wakes up the save thread so the caller never waits on the disk
 void GameBoyAdvance::save() {
-	log << "Saving to " << saveFilePath << std::endl;
-	std::ofstream saveFileStream{saveFilePath, std::ios::binary | std::ios::trunc};
+	saveRequested = true;
+	saveCondition.notify_one();
+}
+
+// Only called on the emulator thread, so save memory can't change during the copy. Doesn't
+// wait for the save thread unless asked to, the sectors stay dirty until the next try.
+void GameBoyAdvance::takeSaveSnapshot(bool wait) {
+	if (!saveDirtySectors.load(std::memory_order_relaxed))
+		return;
+
+	std::unique_lock<std::mutex> lock(saveMutex, std::defer_lock);
+	if (wait) {
+		lock.lock();
+	} else if (!lock.try_lock()) {
+		return;
+	}
+	if (saveSnapshot.size() != sram.size())
+		return;
+
+	u32 dirty = saveDirtySectors.exchange(0, std::memory_order_acquire);
+	if (!sram.mapped()) { // A mapping only needs to be synced
+		for (size_t sector = 0; (sector * 0x1000) < sram.size(); sector++) {
+			if (dirty & (1u << sector)) {
+				size_t offset = sector * 0x1000;
+				std::memcpy(&saveSnapshot[offset], &sram[offset], std::min((size_t)0x1000, sram.size() - offset));
+			}
+		}
+	}
+	saveSnapshotDirty |= dirty;
+}
+
+void GameBoyAdvance::flushSave() {
+	std::lock_guard<std::mutex> fileLock(saveFileMutex);
+	std::vector<u8> data;
+	std::filesystem::path filePath;
+	u32 dirty;
+	{
+		std::lock_guard<std::mutex> lock(saveMutex);
+
+		dirty = saveSnapshotDirty;
+		if (!dirty || saveFilePath.empty())
+			return;
+		saveSnapshotDirty = 0;
+
+		if (sram.mapped()) { // The kernel writes the mapping back to the file, MS_ASYNC doesn't wait for it
+			sram.sync();
+			return;
+		}
+
+		data = saveSnapshot;
+		filePath = saveFilePath;
+	}
+
+	// Saves are at most 128KB, so the whole file is rewritten instead of patching the dirty
+	// sectors in place. Going through a temporary file means a crash or a full disk leaves
+	// the previous save intact, which writing into the file itself can't promise.
+	std::filesystem::path tempFilePath = filePath;
+	tempFilePath += ".tmp";
+	std::ofstream saveFileStream{tempFilePath, std::ios::binary | std::ios::trunc};
 	if (!saveFileStream) {
-		log << "Failed to open/create save file\n";
+		printf("Failed to open/create save file: %s\n", tempFilePath.c_str());
+		std::lock_guard<std::mutex> lock(saveMutex);
+		saveSnapshotDirty |= dirty;
 		return;
 	}
-	saveFileStream.write(reinterpret_cast<const char*>(sram.data()), sram.size());
+	saveFileStream.write(reinterpret_cast<const char*>(data.data()), data.size());
 	saveFileStream.close();
+
+	std::error_code error;
+	std::filesystem::rename(tempFilePath, filePath, error);
+	if (error) {
+		printf("Failed to write save file: %s\n", filePath.c_str());
+		std::lock_guard<std::mutex> lock(saveMutex);
+		saveSnapshotDirty |= dirty;
+	}
+}
+
+void GameBoyAdvance::saveThreadLoop() {
+	std::unique_lock<std::mutex> lock(saveMutex);
+	while (!saveThreadExit) {
+		saveCondition.wait_for(lock, saveFlushInterval, [&]{ return saveRequested || saveThreadExit; });
+		saveRequested = false;
+
+		lock.unlock();
+		flushSave();
+		lock.lock();
+	}
 }
 
 u8 GameBoyAdvance::readDebug(u32 address) {
@@ -233,10 +453,13 @@ u32 GameBoyAdvance::read(u32 address, bool sequential) {
 	u32 alignedAddress = address & ~(sizeof(T) - 1);
 	u32 offset;
 
+	int region = busRegion(address);
+	countBusAccess(region, sizeof(T));
+
 	u32 val = openBus<T>(address);
 	switch (address >> 24) {
 	case 0x00: // BIOS
-		tickPrefetch(1);
+		tickBus(region, 1);
 		if (address >= 0x4000)
 			break;
 
@@ -253,20 +476,20 @@ u32 GameBoyAdvance::read(u32 address, bool sequential) {
 		break;
 	case 0x02: // EWRAM
 		if constexpr (sizeof(T) == 4) {
-			tickPrefetch(ewramCycles * 2);
+			tickBus(region, ewramCycles * 2);
 		} else {
-			tickPrefetch(ewramCycles);
+			tickBus(region, ewramCycles);
 		}
 
 		std::memcpy(&val, &ewram[0] + (alignedAddress & 0x3FFFF), sizeof(T));
 		break;
 	case 0x03: // IWRAM
-		tickPrefetch(1);
+		tickBus(region, 1);
 
 		std::memcpy(&val, &iwram[0] + (alignedAddress & 0x7FFF), sizeof(T));
 		break;
 	case 0x04: // I/O
-		tickPrefetch(1);
+		tickBus(region, 1);
 
 		// Split everything into u8
 		if (sizeof(T) == 4) {
@@ -285,18 +508,18 @@ u32 GameBoyAdvance::read(u32 address, bool sequential) {
 		break;
 	case 0x05: // Palette RAM
 		if constexpr (sizeof(T) == 4) {
-			tickPrefetch(2);
+			tickBus(region, 2);
 		} else {
-			tickPrefetch(1);
+			tickBus(region, 1);
 		}
 
 		std::memcpy(&val, &ppu.paletteRam[0] + (alignedAddress & 0x3FF), sizeof(T));
 		break;
 	case 0x06: // VRAM
 		if constexpr (sizeof(T) == 4) {
-			tickPrefetch(2);
+			tickBus(region, 2);
 		} else {
-			tickPrefetch(1);
+			tickBus(region, 1);
 		}
 
 		offset = alignedAddress & 0x1FFFF;
@@ -305,7 +528,7 @@ u32 GameBoyAdvance::read(u32 address, bool sequential) {
 		std::memcpy(&val, &ppu.vram[0] + offset, sizeof(T));
 		break;
 	case 0x07: // OAM
-		tickPrefetch(1);
+		tickBus(region, 1);
 
 		std::memcpy(&val, &ppu.oam[0] + (alignedAddress & 0x3FF), sizeof(T));
 		break;
@@ -315,57 +538,61 @@ u32 GameBoyAdvance::read(u32 address, bool sequential) {
 
 		if (prefetchBufferEnable) {
 			if constexpr (code) {
+				bool hit = false;
 				if (((prefetchLastAddress == alignedAddress) && (address & 0x1FFFF)) && prefetchRunning) {
 					const int halfwords = sizeof(T) / 2;
+					const u64 sequentialCycles = wsSequentialCycles[prefetchWaitstate];
+					u64 elapsed = prefetchClock - prefetchStartTime;
+					u64 prefetchIndex = elapsed / sequentialCycles;
+
+					if (prefetchIndex <= 8) { // Anything more and the buffer has already stopped
+						hit = true;
 
-					if (halfwords > prefetchIndex) {
-						cpu.tickScheduler(((halfwords - prefetchIndex) * wsSequentialCycles[waitstate]) - prefetchCycles);
+						int cycles;
+						if (halfwords > prefetchIndex) {
+							cycles = ((halfwords - prefetchIndex) * wsSequentialCycles[waitstate]) - (elapsed % sequentialCycles);
+							tickBus(region, cycles);
 
-						prefetchIndex = 0;
-						prefetchCycles = 0;
-					} else {
-						cpu.tickScheduler(1);
+							prefetchStartTime = prefetchClock;
+						} else {
+							cycles = 1;
+							tickBus(region, cycles);
 
-						prefetchIndex -= halfwords;
+							// Remove the halfwords from the buffer without disturbing the one being fetched
+							prefetchStartTime += (halfwords * sequentialCycles) + 1;
+						}
+
+						if (busStatsEnabled.load(std::memory_order_relaxed)) [[unlikely]]
+							busStats[region].prefetchSavedCycles += (sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0) - cycles;
 					}
-				} else {
-					//while (prefetchCycles) tickPrefetch(1);
-					cpu.tickScheduler((sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
+				}
+
+				if (!hit) {
+					tickBus(region, (sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
 
 					prefetchRunning = true;
-					prefetchIndex = 0;
 					prefetchWaitstate = waitstate;
-					prefetchCycles = 0;
+					prefetchStartTime = prefetchClock;
 				}
 
 				prefetchLastAddress = alignedAddress + sizeof(T);
 			} else {
-				if (prefetchRunning && ((wsSequentialCycles[prefetchWaitstate] - prefetchCycles) == 1))
-					cpu.tickScheduler(1);
-
-				prefetchRunning = false;
-				prefetchIndex = 0;
-				prefetchCycles = 0;
+				stopPrefetch();
 
-				cpu.tickScheduler((sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
+				tickBus(region, (sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
 			}
 		} else {
-			cpu.tickScheduler((sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
+			tickBus(region, (sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
 		}
 
 		std::memcpy(&val, (u8*)romBuff.data() + (alignedAddress & 0x1FFFFFF), sizeof(T));
+		if (isEeprom(address)) [[unlikely]]
+			val = readEeprom();
 		} break;
 	case 0x0E ... 0x0F:
-		if (prefetchRunning) {
-			if (prefetchRunning && ((wsSequentialCycles[prefetchWaitstate] - prefetchCycles) == 1)) [[unlikely]]
-				cpu.tickScheduler(1);
+		stopPrefetch();
 
-			prefetchRunning = false;
-			prefetchIndex = 0;
-			prefetchCycles = 0;
-		}
-
-		cpu.tickScheduler(sramCycles);
+		tickBus(region, sramCycles);
 
 		if (saveType == SRAM_32K) {
 			val = sram[address & 0x7FFF];
@@ -387,7 +614,7 @@ u32 GameBoyAdvance::read(u32 address, bool sequential) {
 		}
 		break;
 	default:
-		tickPrefetch(1);
+		tickBus(region, 1);
 		break;
 	}
 
@@ -524,16 +751,23 @@ void GameBoyAdvance::writeDebug(u32 address, u8 value, bool unrestricted) {
 		writeIO(address, value);
 		break;
 	case 0x05: // Palette RAM
+		ppu.catchUp();
 		ppu.paletteRam[address & 0x3FF] = value;
+		ppu.markPaletteDirty(address & 0x3FF);
 		break;
 	case 0x06: // VRAM
+		ppu.catchUp();
 		offset = address & 0x1FFFF;
 		if (offset > 0x17FFF)
 			offset -= 0x8000;
 		ppu.vram[offset] = value;
+		ppu.markVramDirty(offset);
 		break;
 	case 0x07: // OAM
+		ppu.catchUp();
 		ppu.oam[address & 0x3FF] = value;
+		ppu.oamDirty = true;
+		ppu.oamVersion++;
 		break;
 	case 0x08 ... 0x0D: // ROM
 		offset = address & 0x1000000;
@@ -544,12 +778,14 @@ void GameBoyAdvance::writeDebug(u32 address, u8 value, bool unrestricted) {
 	case 0x0E ... 0x0F:
 		if (saveType == SRAM_32K) {
 			sram[address & 0x7FFF] = value;
+			markSaveDirty(address & 0x7FFF);
 		} else if (saveType == FLASH_128K) {
 			value = (u8)value;
 			offset = address & 0xFFFF;
 
 			if (unrestricted) {
 				sram[offset] = value;
+				markSaveDirty(offset);
 			} else if ((offset == 0x0000) && (flashState & BANK)) {
 				flashBank = (value & 1) << 16;
 				flashState = READY;
@@ -558,6 +794,7 @@ void GameBoyAdvance::writeDebug(u32 address, u8 value, bool unrestricted) {
 					log << "Flash command 0xB0: Chose bank " << (value & 1) << "\n";
 			} else if (flashState & WRITE) {
 				sram[flashBank | offset] = value;
+				markSaveDirty(flashBank | offset);
 				flashState = READY;
 
 				if (logFlash)
@@ -574,6 +811,7 @@ void GameBoyAdvance::writeDebug(u32 address, u8 value, bool unrestricted) {
 				} else if (flashState & CMD_2) {
 					if ((value == 0x10) && (flashState & ERASE)) { // Erase entire chip
 						memset(sram.data(), 0xFF, sram.size());
+						markSaveDirty(0, sram.size());
 						flashState = READY;
 
 						if (logFlash)
@@ -610,6 +848,7 @@ void GameBoyAdvance::writeDebug(u32 address, u8 value, bool unrestricted) {
 			} else if ((offset & 0xFFF) == 0) { // Erase 4KB sector
 				if ((value == 0x30) && (flashState & (CMD_2 | ERASE))) {
 					memset(&sram[flashBank | (offset & 0xF000)], 0xFF, 0x1000);
+					markSaveDirty(flashBank | (offset & 0xF000), 0x1000);
 					flashState = READY;
 
 					if (logFlash)
@@ -626,26 +865,29 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 	u32 alignedAddress = address & ~(sizeof(T) - 1);
 	int offset;
 
+	int region = busRegion(address);
+	countBusAccess(region, sizeof(T));
+
 	sequential = sequential && !forceNonSequential && (address & 0x1FFFF);
 	forceNonSequential = false;
 
 	switch (address >> 24) {
 	case 0x02: // EWRAM
 		if constexpr (sizeof(T) == 4) {
-			tickPrefetch(ewramCycles * 2);
+			tickBus(region, ewramCycles * 2);
 		} else {
-			tickPrefetch(ewramCycles);
+			tickBus(region, ewramCycles);
 		}
 
 		std::memcpy(&ewram[0] + (alignedAddress & 0x3FFFF), &value, sizeof(T));
 		break;
 	case 0x03: // IWRAM
-		tickPrefetch(1);
+		tickBus(region, 1);
 
 		std::memcpy(&iwram[0] + (alignedAddress & 0x7FFF), &value, sizeof(T));
 		break;
 	case 0x04: // I/O
-		tickPrefetch(1);
+		tickBus(region, 1);
 
 		if constexpr (sizeof(T) == 4) {
 			writeIO(alignedAddress | 0, (u8)value);
@@ -664,25 +906,28 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 		break;
 	case 0x05: // Palette RAM
 		if constexpr (sizeof(T) == 4) {
-			tickPrefetch(2);
+			tickBus(region, 2);
 		} else {
-			tickPrefetch(1);
+			tickBus(region, 1);
 		}
 
+		ppu.catchUp();
 		if constexpr (sizeof(T) == 1) {
 			ppu.paletteRam[alignedAddress & 0x3FE] = value;
 			ppu.paletteRam[(alignedAddress & 0x3FE) | 1] = value;
 		} else {
 			std::memcpy(&ppu.paletteRam[0] + (alignedAddress & 0x3FF), &value, sizeof(T));
 		}
+		ppu.markPaletteDirty(alignedAddress & 0x3FF);
 		break;
 	case 0x06: // VRAM
 		if constexpr (sizeof(T) == 4) {
-			tickPrefetch(2);
+			tickBus(region, 2);
 		} else {
-			tickPrefetch(1);
+			tickBus(region, 1);
 		}
 
+		ppu.catchUp();
 		offset = alignedAddress & 0x1FFFF;
 		if (offset > 0x17FFF)
 			offset -= 0x8000;
@@ -694,42 +939,36 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 		} else {
 			std::memcpy(&ppu.vram[0] + offset, &value, sizeof(T));
 		}
+		ppu.markVramDirty(offset);
 		break;
 	case 0x07: // OAM
-		tickPrefetch(1);
+		tickBus(region, 1);
 
 		if constexpr (sizeof(T) != 1) {
+			ppu.catchUp();
 			std::memcpy(&ppu.oam[0] + (alignedAddress & 0x3FF), &value, sizeof(T));
+			ppu.oamDirty = true;
+			ppu.oamVersion++;
 		}
 		break;
 	case 0x08 ... 0x0D: { // ROM
 		int waitstate = (address >> 25) & 3;
 
-		if (prefetchRunning) {
-			if (prefetchRunning && ((wsSequentialCycles[prefetchWaitstate] - prefetchCycles) == 1)) [[unlikely]]
-					cpu.tickScheduler(1);
+		stopPrefetch();
 
-			prefetchRunning = false;
-			prefetchIndex = 0;
-			prefetchCycles = 0;
-		}
+		tickBus(region, (sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
 
-		cpu.tickScheduler((sequential ? wsSequentialCycles[waitstate] : wsNonSequentialCycles[waitstate]) + ((sizeof(T) == 4) ? wsSequentialCycles[waitstate] : 0));
+		if (isEeprom(address)) [[unlikely]]
+			writeEeprom((u16)value);
 		} break;
 	case 0x0E ... 0x0F: // SRAM/Flash
-		if (prefetchRunning) {
-			if (prefetchRunning && ((wsSequentialCycles[prefetchWaitstate] - prefetchCycles) == 1)) [[unlikely]]
-					cpu.tickScheduler(1);
+		stopPrefetch();
 
-			prefetchRunning = false;
-			prefetchIndex = 0;
-			prefetchCycles = 0;
-		}
-
-		cpu.tickScheduler(sramCycles);
+		tickBus(region, sramCycles);
 
 		if (saveType == SRAM_32K) {
 			sram[address & 0x7FFF] = (u8)value;
+			markSaveDirty(address & 0x7FFF);
 		} else if (saveType == FLASH_128K) {
 			value = (u8)value;
 			offset = address & 0xFFFF;
@@ -742,6 +981,7 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 					log << "Flash command 0xB0: Chose bank " << (value & 1) << "\n";
 			} else if (flashState & WRITE) {
 				sram[flashBank | offset] = value;
+				markSaveDirty(flashBank | offset);
 				flashState = READY;
 
 				if (logFlash)
@@ -758,6 +998,7 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 				} else if (flashState & CMD_2) {
 					if ((value == 0x10) && (flashState & ERASE)) { // Erase entire chip
 						memset(sram.data(), 0xFF, sram.size());
+						markSaveDirty(0, sram.size());
 						flashState = READY;
 
 						if (logFlash)
@@ -794,6 +1035,7 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 			} else if ((offset & 0xFFF) == 0) { // Erase 4KB sector
 				if ((value == 0x30) && (flashState & (CMD_2 | ERASE))) {
 					memset(&sram[flashBank | (offset & 0xF000)], 0xFF, 0x1000);
+					markSaveDirty(flashBank | (offset & 0xF000), 0x1000);
 					flashState = READY;
 
 					if (logFlash)
@@ -803,7 +1045,7 @@ void GameBoyAdvance::write(u32 address, T value, bool sequential) {
 		}
 		break;
 	default:
-		tickPrefetch(1);
+		tickBus(region, 1);
 		break;
 	}
 }
@@ -847,10 +1089,12 @@ void GameBoyAdvance::writeIO(u32 address, u8 value) {
 			break;
 
 		case 0x132: // Joypad
-			KEYCNT = (KEYCNT & 0xFF00) | value; // TODO
+			KEYCNT = (KEYCNT & 0xFF00) | value;
+			checkKeypadInterrupt();
 			break;
 		case 0x133:
 			KEYCNT = (KEYCNT & 0x00FF) | ((value & 0xC3) << 8);
+			checkKeypadInterrupt();
 			break;
 
 		case 0x200: // Misc.
@@ -879,11 +1123,8 @@ void GameBoyAdvance::writeIO(u32 address, u8 value) {
 			wsSequentialCycles[1] = ws1SequentialControl ? 2 : 5;
 			break;
 		case 0x205:
-			if (prefetchBufferEnable && !(value & 0x40)) {
+			if (prefetchBufferEnable && !(value & 0x40))
 				prefetchRunning = false;
-				prefetchIndex = 0;
-				prefetchCycles = 0;
-			}
 
 			WAITCNT = (WAITCNT & 0x00FF) | ((value & 0x5F) << 8);
 
@@ -916,27 +1157,86 @@ void GameBoyAdvance::writeIO(u32 address, u8 value) {
 	}
 }
 
+// Bit 14 enables the interrupt, bit 15 picks between any (0) or all (1) of the selected keys. KEYINPUT is active low
+void GameBoyAdvance::checkKeypadInterrupt() {
+	if (!(KEYCNT & 0x4000))
+		return;
+
+	u16 selected = KEYCNT & 0x3FF;
+	u16 pressed = ~KEYINPUT & selected;
+	if ((KEYCNT & 0x8000) ? (pressed == selected) : (pressed != 0))
+		cpu.requestInterrupt(GBACPU::IRQ_KEYPAD);
+}
+
 void GameBoyAdvance::internalCycle(int cycles) {
 	forceNonSequential = true;
 
-	tickPrefetch(cycles);
+	tickBus(BUS_INTERNAL, cycles);
 }
 
-void GameBoyAdvance::tickPrefetch(int cycles) {
-	cpu.tickScheduler(cycles);
+void GameBoyAdvance::stopPrefetch() {
+	if (!prefetchRunning)
+		return;
 
-	if (prefetchBufferEnable && prefetchRunning) {
-		prefetchCycles += cycles;
+	// A halfword that is one cycle from arriving still gets to finish
+	u64 sequentialCycles = wsSequentialCycles[prefetchWaitstate];
+	u64 elapsed = prefetchClock - prefetchStartTime;
+	if (((elapsed / sequentialCycles) <= 8) && ((sequentialCycles - (elapsed % sequentialCycles)) == 1)) [[unlikely]]
+		tickBus(BUS_ROM_WS0 + prefetchWaitstate, 1);
 
-		// TODO: Do other waitstates work?
-		prefetchIndex += prefetchCycles / wsSequentialCycles[prefetchWaitstate];
-		prefetchCycles %= wsSequentialCycles[prefetchWaitstate];
+	prefetchRunning = false;
+}
 
-		if (prefetchIndex > 8) {
-			prefetchRunning = false;
-			prefetchIndex = 0;
-			//prefetchIndex = 8;
-			prefetchCycles = 0;
-		}
+const char *GameBoyAdvance::busRegionNames[BUS_REGION_COUNT] = {
+	"BIOS",
+	"EWRAM",
+	"IWRAM",
+	"I/O",
+	"Palette",
+	"VRAM",
+	"OAM",
+	"ROM WS0",
+	"ROM WS1",
+	"ROM WS2",
+	"SRAM",
+	"Unused",
+	"Internal"
+};
+
+// Start counting from the current time so the first frame doesn't include everything since boot
+void GameBoyAdvance::setBusStatsEnabled(bool enable) {
+	if (enable && !busStatsEnabled) {
+		memset(busStats, 0, sizeof(busStats));
+		busStatsFrameStart = cpu.currentTime;
+	}
+	busStatsEnabled = enable;
+}
+
+void GameBoyAdvance::endBusStatsFrame() {
+	if (!busStatsEnabled)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(busStatsMutex);
+		memcpy(busStatsLastFrame, busStats, sizeof(busStats));
+		busStatsLastFrameCycles = cpu.currentTime - busStatsFrameStart;
 	}
+
+	memset(busStats, 0, sizeof(busStats));
+	busStatsFrameStart = cpu.currentTime;
+}
+
+std::string GameBoyAdvance::busStatsReport() {
+	std::lock_guard<std::mutex> lock(busStatsMutex);
+
+	std::string report = fmt::format("{:<10} {:>10} {:>10} {:>10} {:>10}\n", "Region", "Accesses", "Bytes", "Cycles", "Prefetch");
+	u64 totalCycles = 0;
+	for (int i = 0; i < BUS_REGION_COUNT; i++) {
+		const BusStats& stats = busStatsLastFrame[i];
+		report += fmt::format("{:<10} {:>10} {:>10} {:>10} {:>10}\n", busRegionNames[i], stats.accesses, stats.bytes, stats.cycles, stats.prefetchSavedCycles);
+		totalCycles += stats.cycles;
+	}
+	report += fmt::format("Bus cycles {} of {} in the last frame, the rest was halted or outside the bus\n", totalCycles, busStatsLastFrameCycles);
+
+	return report;
 }
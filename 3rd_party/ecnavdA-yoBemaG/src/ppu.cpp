@@ -1,28 +1,90 @@
 
 #include "ppu.hpp"
+#include "colorblend.hpp"
 #include "gba.hpp"
 #include "types.hpp"
+#include <algorithm>
 #include <cstdio>
 #include <locale>
-#include <cmath>
 
 #define convertColor(x) ((x) | 0x8000)
 
 GBAPPU::GBAPPU(GameBoyAdvance& bus_) : bus(bus_) {
 	frameCounter = 0;
+	frameskip = 0;
+	autoFrameskip = false;
+	outputFormat = OUTPUT_RGB555;
+	lineReuseRequested = false;
+	lineReuseEnabled = false;
+	catchUpRequested = false;
+	catchUpRendering = false;
+	lineReuseHits = lineReuseMisses = 0;
+
+	vram = vramData;
+	paletteColors = paletteRamColors;
+	objects = oamObjects;
+	objectMatrices = reinterpret_cast<ObjectMatrix *>(oam);
+	oamVersion = 0;
+	memset(vramVersion, 0, sizeof(vramVersion));
+	memset(paletteVersion, 0, sizeof(paletteVersion));
+
+	memset(presentBuffers, 0, sizeof(presentBuffers));
+	backBuffer = 0;
+	readyBuffer = 1;
+	frontBuffer = 2;
+	presenterWakeup = false;
+
+	debugSnapshotGeneration = 0;
+	debugSnapshotRequested = false;
+
+	renderThreadRequested = false;
+	renderThreadEnabled = false;
+	renderPendingLines = 0;
+	renderedOnThread = false;
+	renderThreadExit = false;
+	renderThread = std::thread(&GBAPPU::renderThreadLoop, this);
 
 	reset();
 }
 
+GBAPPU::~GBAPPU() {
+	{
+		std::lock_guard<std::mutex> lock(renderQueueMutex);
+		renderThreadExit = true;
+	}
+	renderQueueCondition.notify_one();
+	renderThread.join();
+}
+
 void GBAPPU::reset() {
+	pendingLineCount = 0;
+	waitForRenderThread();
+
 	// Clear screen
 	memset(framebuffer, 0, sizeof(framebuffer));
-	updateScreen = true;
+	memset(framebufferRgba, 0, sizeof(framebufferRgba));
+	memset(lineSignaturesValid, 0, sizeof(lineSignaturesValid));
+	publishFrame();
 
 	// Clear memory
 	memset(paletteRam, 0, sizeof(paletteRam));
-	memset(vram, 0, sizeof(vram));
+	std::fill_n(paletteRgba, 0x200, rgba8888Lut[0]);
+	memset(vramData, 0, sizeof(vramData));
 	memset(oam, 0, sizeof(oam));
+	vramDirty = paletteDirty = oamDirty = true;
+	oamVersion++;
+	for (int i = 0; i < 3; i++)
+		vramVersion[i]++;
+	paletteVersion[0]++;
+	paletteVersion[1]++;
+	memset(vramDirtyBlocks, 0xFF, sizeof(vramDirtyBlocks));
+	vramCopy.reset();
+	autoFrameskipAmount = 0;
+	skippedFrames = 0;
+	skipCurrentFrame = false;
+	lastFrameStart = std::chrono::steady_clock::now();
+	paletteCopy.reset();
+	oamCopy.reset();
 
 	win0VertFits = win1VertFits = false;
 	internalBG2X = internalBG2Y = internalBG3X = internalBG3Y = 0;
@@ -42,12 +104,53 @@ void GBAPPU::reset() {
 	WININ = WINOUT = 0;
 	MOSAIC = 0;
 	BLDCNT = BLDALPHA = BLDY = 0;
-	evaCoefficientFloat = evbCoefficientFloat = evyCoefficientFloat = 0;
 
 	bus.cpu.addEvent(1232, lineStartEvent, this);
 	bus.cpu.addEvent(960, hBlankEvent, this);
 }
 
+void GBAPPU::publishFrame() {
+	if (outputFormat == OUTPUT_RGBA8888) {
+		memcpy(presentBuffers[backBuffer], framebufferRgba, sizeof(framebufferRgba));
+	} else {
+		for (int y = 0; y < 160; y++) {
+			for (int x = 0; x < 240; x++)
+				presentBuffers[backBuffer][y][x] = rgba8888Lut[framebuffer[y][x] & 0x7FFF];
+		}
+	}
+
+	backBuffer = readyBuffer.exchange(backBuffer | 4, std::memory_order_acq_rel) & 3;
+	{
+		std::lock_guard<std::mutex> lock(presentMutex);
+	}
+	presentCondition.notify_one();
+}
+
+// Called by the frontend, returns the newest finished frame or nullptr if there's none since the last call
+const u32 *GBAPPU::takeFrame() {
+	if (!(readyBuffer.load(std::memory_order_acquire) & 4))
+		return nullptr;
+
+	frontBuffer = readyBuffer.exchange(frontBuffer, std::memory_order_acq_rel) & 3;
+	return &presentBuffers[frontBuffer][0][0];
+}
+
+// Blocks until a frame is published, wakePresenter is called, or the deadline passes. Returns true if a new frame is ready
+bool GBAPPU::waitForFrame(std::chrono::steady_clock::time_point deadline) {
+	std::unique_lock<std::mutex> lock(presentMutex);
+	presentCondition.wait_until(lock, deadline, [&]{ return (readyBuffer.load(std::memory_order_acquire) & 4) || presenterWakeup; });
+	presenterWakeup = false;
+	return readyBuffer.load(std::memory_order_acquire) & 4;
+}
+
+void GBAPPU::wakePresenter() {
+	{
+		std::lock_guard<std::mutex> lock(presentMutex);
+		presenterWakeup = true;
+	}
+	presentCondition.notify_one();
+}
+
 void GBAPPU::lineStartEvent(void *object) {
 	static_cast<GBAPPU *>(object)->lineStart();
 }
@@ -59,8 +162,13 @@ void GBAPPU::lineStart() {
 	++currentScanline;
 	switch (currentScanline) {
 	case 160: // VBlank
-		updateScreen = true;
+		catchUp();
+		waitForRenderThread();
+		if (!skipCurrentFrame)
+			publishFrame();
 		vBlankFlag = true;
+		bus.endBusStatsFrame();
+		bus.takeSaveSnapshot();
 
 		if (vBlankIrqEnable)
 			bus.cpu.requestInterrupt(GBACPU::IRQ_VBLANK);
@@ -73,11 +181,12 @@ void GBAPPU::lineStart() {
 	case 228: // Start of frame
 		++frameCounter;
 		currentScanline = 0;
+		startFrame();
 
-		internalBG2X = (float)((i32)(BG2X << 4) >> 4) / 256;
-		internalBG2Y = (float)((i32)(BG2Y << 4) >> 4) / 256;
-		internalBG3X = (float)((i32)(BG3X << 4) >> 4) / 256;
-		internalBG3Y = (float)((i32)(BG3Y << 4) >> 4) / 256;
+		internalBG2X = (i32)(BG2X << 4) >> 4;
+		internalBG2Y = (i32)(BG2Y << 4) >> 4;
+		internalBG3X = (i32)(BG3X << 4) >> 4;
+		internalBG3Y = (i32)(BG3Y << 4) >> 4;
 		break;
 	}
 
@@ -111,80 +220,315 @@ void GBAPPU::hBlank() {
 	if (hBlankIrqEnable)
 		bus.cpu.requestInterrupt(GBACPU::IRQ_HBLANK);
 
-	if (currentScanline < 160)
-		drawScanline();
-		bus.dma.onHBlank();
-}
-
-inline void GBAPPU::calculateWindow() {
-	bool win0HorzFits = win0Right < win0Left;
-	bool win1HorzFits = win1Right < win1Left;
-	for (int i = 0; i < 240; i++) {
-		if (win0Left == i)
-			win0HorzFits = true;
-		if (win0Right == i)
-			win0HorzFits = false;
-		if (win1Left == i)
-			win1HorzFits = true;
-		if (win1Right == i)
-			win1HorzFits = false;
-
-		win0Buffer[i] = window0DisplayFlag && win0HorzFits && win0VertFits;
-		win1Buffer[i] = window1DisplayFlag && (win1HorzFits && win1VertFits) && !win0Buffer[i];
-		winObjBuffer[i] = false;
-	}
-	drawObjects(5);
-	for (int i = 0; i < 240; i++)
-		winOutBuffer[i] = !(win0Buffer[i] || win1Buffer[i] || winObjBuffer[i]);
-}
-
-inline void GBAPPU::addPixel(int x, u16 color, int layer, bool semiTransparent) {
-	Pixel *pix = &mergedBuffer[x];
-	bool fitsWindow = !(window0DisplayFlag || window1DisplayFlag || windowObjDisplayFlag) ||
-						(win0BldEnable && win0Buffer[x]) ||
-						(win1BldEnable && win1Buffer[x]) ||
-						(winObjBldEnable && winObjBuffer[x]) ||
-						(winOutBldEnable && winOutBuffer[x]);
-
-	if (pix->layer == -1) { // Drawing top pixel
-		if (fitsWindow) {
-			if ((BLDCNT & (1 << layer)) || semiTransparent) { // Make sure new pixel is first target
-				pix->oldColor = color;
-				if (blendMode == 2) {
-					// I really hope these variables get optimized out
-					int red = color & 0x1F;
-					int green = (color >> 5) & 0x1F;
-					int blue = (color >> 10) & 0x1F;
-					color = (red + (int)((31 - red) * evyCoefficientFloat)) |
-							((green + (int)((31 - green) * evyCoefficientFloat)) << 5) |
-							((blue + (int)((31 - blue) * evyCoefficientFloat)) << 10);
-				}
-				if (blendMode == 3) {
-					int red = color & 0x1F;
-					int green = (color >> 5) & 0x1F;
-					int blue = (color >> 10) & 0x1F;
-					color = (red - (int)(red * evyCoefficientFloat)) |
-							((green - (int)(green * evyCoefficientFloat)) << 5) |
-							((blue - (int)(blue * evyCoefficientFloat)) << 10);
-				}
+	if (currentScanline < 160) {
+		if (!skipCurrentFrame) {
+			if (catchUpRendering) {
+				if (pendingLineCount == 0)
+					pendingLineFirst = currentScanline;
+				pendingLines[currentScanline] = {win0VertFits, win1VertFits, internalBG2X, internalBG2Y, internalBG3X, internalBG3Y};
+				++pendingLineCount;
+			} else {
+				catchUp();
+				drawScanline(*this);
 			}
 		}
 
-		pix->color = color;
-		pix->layer = layer;
-		pix->semiTransparent = semiTransparent;
-	} else if (fitsWindow && ((blendMode == 1) || pix->semiTransparent)) {
-		if ((BLDCNT & (1 << pix->layer)) || pix->semiTransparent) { // Make sure old pixel is first target
-			if (BLDCNT & (0x100 << layer)) { // Make sure new pixel is second target
-				if (pix->semiTransparent)
-					pix->color = pix->oldColor;
-				pix->color = std::min(31, (int)((pix->color & 0x1F) * evaCoefficientFloat) + (int)((color & 0x1F) * evbCoefficientFloat)) |
-						(std::min(31, (int)(((pix->color >> 5) & 0x1F) * evaCoefficientFloat) + (int)(((color >> 5) & 0x1F) * evbCoefficientFloat)) << 5) |
-						(std::min(31, (int)(((pix->color >> 10) & 0x1F) * evaCoefficientFloat) + (int)(((color >> 10) & 0x1F) * evbCoefficientFloat)) << 10);
-			}
+		if (!forcedBlank) {
+			internalBG2X += BG2PB;
+			internalBG2Y += BG2PD;
+			internalBG3X += BG3PB;
+			internalBG3Y += BG3PD;
+		}
+	}
+	bus.dma.onHBlank();
+}
+
+void GBAPPU::startFrame() {
+	renderThreadEnabled = renderThreadRequested.load(std::memory_order_relaxed);
+	lineReuseEnabled = lineReuseRequested.load(std::memory_order_relaxed);
+	catchUpRendering = catchUpRequested.load(std::memory_order_relaxed);
+
+	auto now = std::chrono::steady_clock::now();
+	auto frameTime = now - lastFrameStart;
+	lastFrameStart = now;
+
+	// Back off slowly, a frame that was exactly on time might have been waiting on audio
+	if (bus.cpu.uncapFps) {
+		autoFrameskipAmount = maxFrameskip;
+	} else if (frameTime > (gbaFrameTime * 11 / 10)) {
+		autoFrameskipAmount = std::min(autoFrameskipAmount + 1, maxFrameskip);
+	} else if ((frameTime < (gbaFrameTime * 102 / 100)) && !skipCurrentFrame) {
+		autoFrameskipAmount = std::max(autoFrameskipAmount - 1, 0);
+	}
+
+	int skip = autoFrameskip ? autoFrameskipAmount : std::clamp(frameskip, 0, maxFrameskip);
+	if (skippedFrames < skip) {
+		skipCurrentFrame = true;
+		++skippedFrames;
+	} else {
+		skipCurrentFrame = false;
+		skippedFrames = 0;
+	}
+}
+
+// Draws the lines that were put off by catch-up rendering, using the registers as they are
+// now apart from the ones that change every line. Anything else changing would have caught up first.
+void GBAPPU::drawPendingLines() {
+	GBAPPUState lineState = *this;
+	for (int line = pendingLineFirst; line < (pendingLineFirst + pendingLineCount); line++) {
+		PendingLine& pending = pendingLines[line];
+		lineState.currentScanline = line;
+		lineState.win0VertFits = pending.win0VertFits;
+		lineState.win1VertFits = pending.win1VertFits;
+		lineState.internalBG2X = pending.internalBG2X;
+		lineState.internalBG2Y = pending.internalBG2Y;
+		lineState.internalBG3X = pending.internalBG3X;
+		lineState.internalBG3Y = pending.internalBG3Y;
+		drawScanline(lineState);
+	}
+
+	pendingLineCount = 0;
+}
+
+void GBAPPU::drawScanline(const GBAPPUState& state) {
+	if (renderThreadEnabled) {
+		ScanlineJob job;
+		job.state = state;
+
+		if (vramDirty || !vramCopy) {
+			vramCopy = std::shared_ptr<u8[]>(new u8[sizeof(vramData)]);
+			memcpy(vramCopy.get(), vramData, sizeof(vramData));
+			vramDirty = false;
+		}
+		if (paletteDirty || !paletteCopy) {
+			paletteCopy = std::shared_ptr<u8[]>(new u8[sizeof(paletteRam)]);
+			memcpy(paletteCopy.get(), paletteRam, sizeof(paletteRam));
+			paletteDirty = false;
+		}
+		if (oamDirty || !oamCopy) {
+			oamCopy = std::shared_ptr<u8[]>(new u8[sizeof(oam)]);
+			memcpy(oamCopy.get(), oam, sizeof(oam));
+			oamDirty = false;
+		}
+		if (!renderedOnThread) // The other renderer's tile cache doesn't know about any writes before now
+			memset(vramDirtyBlocks, 0xFF, sizeof(vramDirtyBlocks));
+		memcpy(job.vramDirtyBlocks, vramDirtyBlocks, sizeof(vramDirtyBlocks));
+		memset(vramDirtyBlocks, 0, sizeof(vramDirtyBlocks));
+		renderedOnThread = true;
+
+		job.outputFormat = outputFormat;
+		job.vram = vramCopy;
+		job.palette = paletteCopy;
+		job.oam = oamCopy;
+		job.state.vram = vramCopy.get();
+		job.state.paletteColors = reinterpret_cast<u16 *>(paletteCopy.get());
+		job.state.objects = reinterpret_cast<Object *>(oamCopy.get());
+		job.state.objectMatrices = reinterpret_cast<ObjectMatrix *>(oamCopy.get());
+
+		{
+			std::lock_guard<std::mutex> lock(renderQueueMutex);
+			renderQueue.push(std::move(job));
+			++renderPendingLines;
+		}
+		renderQueueCondition.notify_one();
+	} else {
+		if (renderedOnThread)
+			memset(vramDirtyBlocks, 0xFF, sizeof(vramDirtyBlocks));
+		renderer.invalidateTileRows(vramDirtyBlocks);
+		memset(vramDirtyBlocks, 0, sizeof(vramDirtyBlocks));
+		renderedOnThread = false;
+
+		static_cast<GBAPPUState&>(renderer) = state;
+		drawLine(renderer, outputFormat);
+	}
+}
+
+void GBAPPU::makeLineSignature(LineSignature& signature, const GBAPPUState& state, OutputFormat format) {
+	u32 *value = signature.values;
+	*value++ = format;
+	*value++ = state.DISPCNT;
+	*value++ = state.greenSwap;
+	*value++ = state.win0VertFits | (state.win1VertFits << 1);
+	*value++ = state.BG0CNT;
+	*value++ = state.BG1CNT;
+	*value++ = state.BG2CNT;
+	*value++ = state.BG3CNT;
+	*value++ = state.BG0HOFS;
+	*value++ = state.BG0VOFS;
+	*value++ = state.BG1HOFS;
+	*value++ = state.BG1VOFS;
+	*value++ = state.BG2HOFS;
+	*value++ = state.BG2VOFS;
+	*value++ = state.BG3HOFS;
+	*value++ = state.BG3VOFS;
+	*value++ = (u16)state.BG2PA;
+	*value++ = (u16)state.BG2PC;
+	*value++ = (u16)state.BG3PA;
+	*value++ = (u16)state.BG3PC;
+	*value++ = state.internalBG2X;
+	*value++ = state.internalBG2Y;
+	*value++ = state.internalBG3X;
+	*value++ = state.internalBG3Y;
+	*value++ = state.WIN0H;
+	*value++ = state.WIN1H;
+	*value++ = state.WIN0V;
+	*value++ = state.WIN1V;
+	*value++ = state.WININ;
+	*value++ = state.WINOUT;
+	*value++ = state.MOSAIC;
+	*value++ = state.BLDCNT;
+	*value++ = state.BLDALPHA;
+	*value++ = state.BLDY;
+
+	// Memory the line can't read doesn't have to match
+	bool objects = state.screenDisplayObj;
+	bool bitmap = state.bgMode >= 3;
+	*value++ = state.vramVersion[0];
+	*value++ = (objects || bitmap) ? state.vramVersion[1] : 0;
+	*value++ = objects ? state.vramVersion[2] : 0;
+	*value++ = state.paletteVersion[0];
+	*value++ = objects ? state.paletteVersion[1] : 0;
+	*value++ = objects ? state.oamVersion : 0;
+}
+
+void GBAPPU::drawLine(GBAPPURenderer& lineRenderer, OutputFormat format) {
+	int line = lineRenderer.currentScanline;
+	if (lineReuseEnabled) {
+		LineSignature signature;
+		makeLineSignature(signature, lineRenderer, format);
+		if (lineSignaturesValid[line] && (signature == lineSignatures[line])) {
+			lineReuseHits.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		lineReuseMisses.fetch_add(1, std::memory_order_relaxed);
+		lineSignatures[line] = signature;
+		lineSignaturesValid[line] = true;
+	} else {
+		lineSignaturesValid[line] = false;
+	}
+
+	if (format == OUTPUT_RGBA8888) {
+		lineRenderer.drawScanline(framebufferRgba[line]);
+	} else {
+		lineRenderer.drawScanline(framebuffer[line]);
+	}
+}
+
+// Called by the frontend, the copy is made the next time the emulator thread handles thread events
+void GBAPPU::requestDebugSnapshot() {
+	if (!debugSnapshotRequested.exchange(true))
+		bus.cpu.addThreadEvent(GBACPU::DEBUG_SNAPSHOT);
+}
+
+void GBAPPU::takeDebugSnapshot() {
+	debugSnapshotRequested = false;
+
+	// Never wait for the debug views, they will ask again
+	std::unique_lock<std::mutex> lock(debugSnapshotMutex, std::try_to_lock);
+	if (!lock.owns_lock())
+		return;
+
+	const GBAPPUState& last = debugSnapshot.state;
+	bool changed = (debugSnapshotGeneration == 0) || (DISPCNT != last.DISPCNT) ||
+		(BG0CNT != last.BG0CNT) || (BG1CNT != last.BG1CNT) || (BG2CNT != last.BG2CNT) || (BG3CNT != last.BG3CNT) ||
+		memcmp(vramVersion, last.vramVersion, sizeof(vramVersion)) || memcmp(paletteVersion, last.paletteVersion, sizeof(paletteVersion));
+	if (!changed)
+		return;
+
+	debugSnapshot.state = *this;
+	memcpy(debugSnapshot.vram, vramData, sizeof(vramData));
+	memcpy(debugSnapshot.paletteRgba, paletteRgba, sizeof(paletteRgba));
+	debugSnapshotGeneration++;
+}
+
+void GBAPPU::renderThreadLoop() {
+	std::unique_lock<std::mutex> lock(renderQueueMutex);
+	while (true) {
+		renderQueueCondition.wait(lock, [&]{ return !renderQueue.empty() || renderThreadExit; });
+		if (renderQueue.empty())
+			return;
+
+		ScanlineJob job = std::move(renderQueue.front());
+		renderQueue.pop();
+		lock.unlock();
+
+		static_cast<GBAPPUState&>(threadRenderer) = job.state;
+		threadRenderer.invalidateTileRows(job.vramDirtyBlocks);
+		drawLine(threadRenderer, job.outputFormat);
+
+		lock.lock();
+		if (--renderPendingLines == 0)
+			renderDoneCondition.notify_all();
+	}
+}
+
+void GBAPPU::waitForRenderThread() {
+	std::unique_lock<std::mutex> lock(renderQueueMutex);
+	renderDoneCondition.wait(lock, [&]{ return renderPendingLines == 0; });
+}
+
+static inline bool windowCovers(int left, int right, int x) {
+	return (right < left) ? ((x < right) || (x >= left)) : ((x >= left) && (x < right));
+}
+
+void GBAPPURenderer::addWindowSpan(int start, int end, u8 mask) {
+	if (windowSpanCount && (windowSpans[windowSpanCount - 1].mask == mask)) {
+		windowSpans[windowSpanCount - 1].end = end;
+	} else {
+		windowSpans[windowSpanCount++] = {(u8)start, (u8)end, mask};
+	}
+}
+
+// Splits the line into spans that share the same window settings. Window 0 and 1 only
+// change at their edges, the object window is the only one that has to be checked per pixel.
+inline void GBAPPURenderer::calculateWindow() {
+	windowSpanCount = 0;
+	if (!(window0DisplayFlag || window1DisplayFlag || windowObjDisplayFlag)) {
+		addWindowSpan(0, 240, 0x3F);
+		return;
+	}
+
+	bool win0 = window0DisplayFlag && win0VertFits;
+	bool win1 = window1DisplayFlag && win1VertFits;
+	bool objWindow = windowObjDisplayFlag && screenDisplayObj;
+	if (objWindow) {
+		memset(objWindowLine, 0, sizeof(objWindowLine));
+		drawObjects(true);
+	}
+
+	int edges[6] = {0, 240};
+	int edgeCount = 2;
+	auto addEdge = [&](int x) {
+		if ((x > 0) && (x < 240))
+			edges[edgeCount++] = x;
+	};
+	if (win0) {
+		addEdge(win0Left);
+		addEdge(win0Right);
+	}
+	if (win1) {
+		addEdge(win1Left);
+		addEdge(win1Right);
+	}
+	std::sort(edges, edges + edgeCount);
+
+	for (int i = 0; i < (edgeCount - 1); i++) {
+		int start = edges[i];
+		int end = edges[i + 1];
+		if (start == end)
+			continue;
+
+		if (win0 && windowCovers(win0Left, win0Right, start)) {
+			addWindowSpan(start, end, WININ & 0x3F);
+		} else if (win1 && windowCovers(win1Left, win1Right, start)) {
+			addWindowSpan(start, end, (WININ >> 8) & 0x3F);
+		} else if (objWindow) {
+			for (int x = start; x < end; x++)
+				addWindowSpan(x, x + 1, objWindowLine[x] ? ((WINOUT >> 8) & 0x3F) : (WINOUT & 0x3F));
+		} else {
+			addWindowSpan(start, end, WINOUT & 0x3F);
 		}
-		pix->layer = layer;
-		pix->semiTransparent = semiTransparent;
 	}
 }
 
@@ -195,137 +539,155 @@ static const unsigned int objSizeArray[4][4][2] = {
 	{{0, 0}, {0, 0}, {0, 0}, {0, 0}}
 };
 
-void GBAPPU::drawObjects(int priority) {
-	if (!screenDisplayObj)
-		return;
-	bool drawWin = priority == 5;
-	if (drawWin && !windowObjDisplayFlag)
+// Sorts objects into the scanlines they cover. Each line lists the object window objects
+// first, then the other objects by priority and OAM index, so the first one to draw wins.
+void GBAPPURenderer::buildObjectLists() {
+	objectListsVersion = oamVersion;
+	objectListsBuilt = true;
+	memset(lineObjectCount, 0, sizeof(lineObjectCount));
+	memset(lineWindowObjectCount, 0, sizeof(lineWindowObjectCount));
+
+	for (int pass = -1; pass < 4; pass++) { // -1 is the object window
+		for (int objNo = 0; objNo < 128; objNo++) {
+			Object *obj = &objects[objNo];
+			if ((obj->objMode == 2) || ((pass == -1) ? (obj->gfxMode != 2) : ((obj->gfxMode == 2) || (obj->priority != pass))))
+				continue;
+
+			ObjectBounds& bounds = objectBounds[objNo];
+			bounds.xSize = objSizeArray[obj->shape][obj->size][0];
+			bounds.ySize = objSizeArray[obj->shape][obj->size][1];
+			bounds.width = bounds.xSize << (obj->objMode == 3);
+			bounds.height = bounds.ySize << (obj->objMode == 3);
+			bounds.tileBase = (obj->tileIndex & ~(1 * obj->bpp)) * 32;
+
+			for (unsigned int line = 0; line < bounds.height; line++) {
+				u8 y = obj->objY + line;
+				if (y >= 160)
+					continue;
+
+				lineObjects[y][lineObjectCount[y]++] = objNo;
+				if (pass == -1)
+					++lineWindowObjectCount[y];
+			}
+		}
+	}
+}
+
+// Draws either the object window or the object layer. For the layer, each pixel keeps
+// the first object in the line's list that isn't transparent there.
+void GBAPPURenderer::drawObjects(bool window) {
+	if (!window) {
+		memset(objLine, 0, sizeof(objLine));
+		if (!screenDisplayObj)
+			return;
+	} else if (!screenDisplayObj || !windowObjDisplayFlag) {
 		return;
+	}
+
+	if (!objectListsBuilt || (objectListsVersion != oamVersion))
+		buildObjectLists();
 
 	int tileRowAddress = 0;
 	int tileDataAddress = 0;
 	u8 tileData = 0;
 
-	for (int objNo = 0; objNo < 128; objNo++) {
+	int first = window ? 0 : lineWindowObjectCount[currentScanline];
+	int last = window ? lineWindowObjectCount[currentScanline] : lineObjectCount[currentScanline];
+	for (int listIndex = first; listIndex < last; listIndex++) {
+		int objNo = lineObjects[currentScanline][listIndex];
 		Object *obj = &objects[objNo];
-		if ((((obj->priority == priority) && (obj->gfxMode != 2)) || (drawWin && (obj->gfxMode == 2))) && (obj->objMode != 2)) {
-			ObjectMatrix mat = objectMatrices[obj->affineIndex];
-			unsigned int xSize = objSizeArray[obj->shape][obj->size][0];
-			unsigned int ySize = objSizeArray[obj->shape][obj->size][1];
-
-			unsigned int x = obj->objX;
-			u8 y = currentScanline - obj->objY;
-			u8 mosY = (obj->mosaic ? (currentScanline - (currentScanline % (objMosV + 1))) : currentScanline) - obj->objY;
-			int yMod = obj->verticalFlip ? (7 - (mosY % 8)) : (mosY % 8);
-
-			float affX = 0;
-			float affY = 0;
-			float pa = (float)mat.pa / 256;
-			float pb = (float)mat.pb / 256;
-			float pc = (float)mat.pc / 256;
-			float pd = (float)mat.pd / 256;
-			if (obj->objMode == 1) { // Affine
-				affX = (pb * (y - ((float)ySize / 2))) + (pa * ((float)xSize / -2)) + ((float)xSize / 2);
-				affY = (pd * (y - ((float)ySize / 2))) + (pc * ((float)xSize / -2)) + ((float)ySize / 2);
-			} else if (obj->objMode == 3) { // Affine double size
-				affX = (pb * (y - (float)ySize)) + (pa * ((float)xSize * -1)) + ((float)xSize / 2);
-				affY = (pd * (y - (float)ySize)) + (pc * ((float)xSize * -1)) + ((float)ySize / 2);
-
-				ySize <<= 1;
-			}
-
-			if ((obj->objY + ySize) > 255) { // Decide if object is on this scanline
-				if ((currentScanline < obj->objY) && (currentScanline >= (u8)(obj->objY + ySize)))
-					continue;
-			} else {
-				if ((currentScanline < obj->objY) || (currentScanline >= (obj->objY + ySize)))
-					continue;
-			}
+		ObjectMatrix mat = objectMatrices[obj->affineIndex];
+		unsigned int xSize = objectBounds[objNo].xSize;
+		unsigned int ySize = objectBounds[objNo].ySize;
+
+		unsigned int x = obj->objX;
+		u8 y = currentScanline - obj->objY;
+		u8 mosY = (obj->mosaic ? (currentScanline - (currentScanline % (objMosV + 1))) : currentScanline) - obj->objY;
+		int yMod = obj->verticalFlip ? (7 - (mosY % 8)) : (mosY % 8);
+
+		// Affine objects are sampled around their center in 20.8 fixed point
+		i32 affX = 0;
+		i32 affY = 0;
+		if (obj->objMode == 1) { // Affine
+			affX = (mat.pb * ((int)y - (int)(ySize / 2))) - (mat.pa * (int)(xSize / 2)) + ((xSize / 2) << 8);
+			affY = (mat.pd * ((int)y - (int)(ySize / 2))) - (mat.pc * (int)(xSize / 2)) + ((ySize / 2) << 8);
+		} else if (obj->objMode == 3) { // Affine double size
+			affX = (mat.pb * ((int)y - (int)ySize)) - (mat.pa * (int)xSize) + ((xSize / 2) << 8);
+			affY = (mat.pd * ((int)y - (int)ySize)) - (mat.pc * (int)xSize) + ((ySize / 2) << 8);
+		}
 
-			if (obj->objMode == 3)
-				ySize >>= 1;
-
-			for (unsigned int relX = 0; relX < (xSize << (obj->objMode == 3)); relX++) {
-				if (x < 240) {
-					if ((mergedBuffer[x].layer == -1) || ((blendMode == 1) && (mergedBuffer[x].layer != 4))) {
-						if ((obj->objMode == 1) || (obj->objMode == 3)) {
-							unsigned int mosX = floor(affX);
-							mosY = floor(affY);
-							if (obj->mosaic) {
-								mosX = mosX - (mosX % (objMosH + 1));
-								mosY = mosY - (mosY % (objMosV + 1));
-							}
-							if ((mosX < xSize) && (mosY < ySize)) {
-								tileDataAddress = 0x10000 + ((obj->tileIndex & ~(1 * obj->bpp)) * 32) + (((((int)mosY / 8) * (objMappingDimension ? (xSize / 8) : (32 >> obj->bpp))) + ((int)mosX / 8)) * (32 << obj->bpp)) + (((unsigned int)mosY & 7) * (4 << obj->bpp)) + (((unsigned int)mosX & 7) / (2 >> obj->bpp));
-
-								tileData = vram[tileDataAddress];
-								if (!obj->bpp) {
-									if (mosX & 1) {
-										tileData >>= 4;
-									} else {
-										tileData &= 0xF;
-									}
-								}
-							} else {
-								tileData = 0;
-							}
-						} else {
-							unsigned int mosX = ((obj->mosaic ? (x - (x % (objMosH + 1))) : x) - obj->objX) & 0x1FF;
-							if ((mosX >= 0) && (mosX < xSize)) {
-								tileRowAddress = 0x10000 + ((obj->tileIndex & ~(1 * obj->bpp)) * 32) + (((((obj->verticalFlip ? (ySize - 1 - mosY) : mosY) / 8) * (objMappingDimension ? (xSize / 8) : (32 >> obj->bpp))) + ((obj->horizontalFlip ? (xSize - 1 - mosX) : mosX) / 8)) * (32 << obj->bpp)) + (yMod * (4 << obj->bpp));
-								if (((tileRowAddress <= 0x14000) && (bgMode >= 3)) || (tileRowAddress >= 0x18000))
-									break;
-
-								int xMod = obj->horizontalFlip ? (7 - (mosX % 8)) : (mosX % 8);
-								if (obj->bpp) { // 8 bits per pixel
-									tileData = vram[tileRowAddress + xMod];
-								} else { // 4 bits per pixel
-									tileData = vram[tileRowAddress + (xMod / 2)];
-
-									if (xMod & 1) {
-										tileData >>= 4;
-									} else {
-										tileData &= 0xF;
-									}
-								}
+		u8 info = obj->priority | ((obj->gfxMode == 1) << 2);
+		for (unsigned int relX = 0; relX < objectBounds[objNo].width; relX++) {
+			if ((x < 240) && (window || !(objLine[x] & 0x8000))) {
+				if ((obj->objMode == 1) || (obj->objMode == 3)) {
+					int texX = affX >> 8;
+					int texY = affY >> 8;
+					if (obj->mosaic) {
+						texX -= texX % (objMosH + 1);
+						texY -= texY % (objMosV + 1);
+					}
+					unsigned int mosX = texX;
+					mosY = texY;
+					if ((mosX < xSize) && ((unsigned int)texY < ySize)) {
+						// Tile numbers wrap around inside the 32KB of object VRAM
+						tileDataAddress = 0x10000 + ((objectBounds[objNo].tileBase + (((((int)mosY / 8) * (objMappingDimension ? (xSize / 8) : (32 >> obj->bpp))) + ((int)mosX / 8)) * (32 << obj->bpp)) + (((unsigned int)mosY & 7) * (4 << obj->bpp)) + (((unsigned int)mosX & 7) / (2 >> obj->bpp))) & 0x7FFF);
+
+						tileData = vram[tileDataAddress];
+						if (!obj->bpp) {
+							if (mosX & 1) {
+								tileData >>= 4;
 							} else {
-								tileData = 0;
+								tileData &= 0xF;
 							}
 						}
-
-						if (drawWin) {
-							// Pixel is in object window if non-transparent and not in win0 or win1
-							if (tileData &&
-								!(window0DisplayFlag && win0Buffer[x]) &&
-								!(window1DisplayFlag && win1Buffer[x])) {
-								winObjBuffer[x] = true;
-							}
-						} else {
-							if (tileData) {
-								if (!(window0DisplayFlag || window1DisplayFlag || windowObjDisplayFlag) ||
-									(win0ObjEnable && win0Buffer[x]) ||
-									(win1ObjEnable && win1Buffer[x]) ||
-									(winObjObjEnable && winObjBuffer[x]) ||
-									(winOutObjEnable && winOutBuffer[x])) {
-									addPixel(x, paletteColors[0x100 | ((obj->palette << 4) * !obj->bpp) | tileData], 4, (obj->gfxMode == 1));
-								}
+					} else {
+						tileData = 0;
+					}
+				} else {
+					unsigned int mosX = ((obj->mosaic ? (x - (x % (objMosH + 1))) : x) - obj->objX) & 0x1FF;
+					if ((mosX >= 0) && (mosX < xSize)) {
+						tileRowAddress = 0x10000 + objectBounds[objNo].tileBase + (((((obj->verticalFlip ? (ySize - 1 - mosY) : mosY) / 8) * (objMappingDimension ? (xSize / 8) : (32 >> obj->bpp))) + ((obj->horizontalFlip ? (xSize - 1 - mosX) : mosX) / 8)) * (32 << obj->bpp)) + (yMod * (4 << obj->bpp));
+						if (((tileRowAddress <= 0x14000) && (bgMode >= 3)) || (tileRowAddress >= 0x18000))
+							break;
+
+						int xMod = obj->horizontalFlip ? (7 - (mosX % 8)) : (mosX % 8);
+						if (obj->bpp) { // 8 bits per pixel
+							tileData = vram[tileRowAddress + xMod];
+						} else { // 4 bits per pixel
+							tileData = vram[tileRowAddress + (xMod / 2)];
+
+							if (xMod & 1) {
+								tileData >>= 4;
+							} else {
+								tileData &= 0xF;
 							}
 						}
+					} else {
+						tileData = 0;
 					}
 				}
 
-				if ((obj->objMode == 1) || (obj->objMode == 3)) {
-					affX += pa;
-					affY += pc;
+				if (tileData) {
+					if (window) {
+						objWindowLine[x] = 1;
+					} else {
+						objLine[x] = paletteColors[0x100 | ((obj->palette << 4) * !obj->bpp) | tileData] | 0x8000;
+						objLineInfo[x] = info;
+					}
 				}
-				x = (x + 1) & 0x1FF;
 			}
+
+			if ((obj->objMode == 1) || (obj->objMode == 3)) {
+				affX += mat.pa;
+				affY += mat.pc;
+			}
+			x = (x + 1) & 0x1FF;
 		}
 	}
 }
 
 template <int bgNum, int size>
-int GBAPPU::calculateTilemapIndex(int x, int y) {
+int GBAPPURenderer::calculateTilemapIndex(int x, int y) {
 	int baseBlock;
 	switch (bgNum) {
 	case 0: baseBlock = bg0ScreenBaseBlock; break;
@@ -345,82 +707,105 @@ int GBAPPU::calculateTilemapIndex(int x, int y) {
 		return ((baseBlock + ((x >> 8) & 1)) * 0x800) + (16 * (y & 0x100)) + (((y % 256) / 8) * 64) + (((x % 256) / 8) * 2);
 	}
 }
-constexpr std::array<int (GBAPPU::*)(int, int), 16> tilemapIndexLUT = {
-	&GBAPPU::calculateTilemapIndex<0, 0>,
-	&GBAPPU::calculateTilemapIndex<0, 1>,
-	&GBAPPU::calculateTilemapIndex<0, 2>,
-	&GBAPPU::calculateTilemapIndex<0, 3>,
-	&GBAPPU::calculateTilemapIndex<1, 0>,
-	&GBAPPU::calculateTilemapIndex<1, 1>,
-	&GBAPPU::calculateTilemapIndex<1, 2>,
-	&GBAPPU::calculateTilemapIndex<1, 3>,
-	&GBAPPU::calculateTilemapIndex<2, 0>,
-	&GBAPPU::calculateTilemapIndex<2, 1>,
-	&GBAPPU::calculateTilemapIndex<2, 2>,
-	&GBAPPU::calculateTilemapIndex<2, 3>,
-	&GBAPPU::calculateTilemapIndex<3, 0>,
-	&GBAPPU::calculateTilemapIndex<3, 1>,
-	&GBAPPU::calculateTilemapIndex<3, 2>,
-	&GBAPPU::calculateTilemapIndex<3, 3>
+constexpr std::array<int (GBAPPURenderer::*)(int, int), 16> tilemapIndexLUT = {
+	&GBAPPURenderer::calculateTilemapIndex<0, 0>,
+	&GBAPPURenderer::calculateTilemapIndex<0, 1>,
+	&GBAPPURenderer::calculateTilemapIndex<0, 2>,
+	&GBAPPURenderer::calculateTilemapIndex<0, 3>,
+	&GBAPPURenderer::calculateTilemapIndex<1, 0>,
+	&GBAPPURenderer::calculateTilemapIndex<1, 1>,
+	&GBAPPURenderer::calculateTilemapIndex<1, 2>,
+	&GBAPPURenderer::calculateTilemapIndex<1, 3>,
+	&GBAPPURenderer::calculateTilemapIndex<2, 0>,
+	&GBAPPURenderer::calculateTilemapIndex<2, 1>,
+	&GBAPPURenderer::calculateTilemapIndex<2, 2>,
+	&GBAPPURenderer::calculateTilemapIndex<2, 3>,
+	&GBAPPURenderer::calculateTilemapIndex<3, 0>,
+	&GBAPPURenderer::calculateTilemapIndex<3, 1>,
+	&GBAPPURenderer::calculateTilemapIndex<3, 2>,
+	&GBAPPURenderer::calculateTilemapIndex<3, 3>
 };
 
+// Tile rows are decoded 32 bytes of VRAM at a time into one palette index per pixel
+const u8 *GBAPPURenderer::tileRow(int address, bool bpp) {
+	int block = address >> 5;
+	u64 bit = 1ULL << (block & 63);
+	if (bpp) { // 8 bits per pixel
+		if (!(tileRowsValid8[block >> 6] & bit)) {
+			memcpy(tileRows8[block * 4], &vram[block * 32], 32);
+			tileRowsValid8[block >> 6] |= bit;
+		}
+
+		return tileRows8[address >> 3];
+	} else { // 4 bits per pixel
+		if (!(tileRowsValid4[block >> 6] & bit)) {
+			for (int i = 0; i < 32; i++) {
+				u8 data = vram[(block * 32) + i];
+				tileRows4[(block * 8) + (i / 4)][(i & 3) * 2] = data & 0xF;
+				tileRows4[(block * 8) + (i / 4)][((i & 3) * 2) + 1] = data >> 4;
+			}
+			tileRowsValid4[block >> 6] |= bit;
+		}
+
+		return tileRows4[address >> 2];
+	}
+}
+
+void GBAPPURenderer::invalidateTileRows(const u64 *dirtyBlocks) {
+	for (int i = 0; i < 32; i++) {
+		tileRowsValid4[i] &= ~dirtyBlocks[i];
+		tileRowsValid8[i] &= ~dirtyBlocks[i];
+	}
+}
+
 template <int bgNum>
-void GBAPPU::drawBgTile() {
+void GBAPPURenderer::drawBgTile() {
 	int xOffset;
 	int yOffset;
 	int screenSize;
 	bool bpp;
 	int characterBaseBlock;
 	bool mosaic;
-	u16 winRegMask;
 	switch (bgNum) {
 	case 0:
-		if (!screenDisplayBg0) return;
 		xOffset = BG0HOFS;
 		yOffset = BG0VOFS;
 		screenSize = bg0ScreenSize;
 		bpp = bg0Bpp;
 		characterBaseBlock = bg0CharacterBaseBlock;
 		mosaic = bg0Mosaic;
-		winRegMask = 0x01;
 		break;
 	case 1:
-		if (!screenDisplayBg1) return;
 		xOffset = BG1HOFS;
 		yOffset = BG1VOFS;
 		screenSize = bg1ScreenSize;
 		bpp = bg1Bpp;
 		characterBaseBlock = bg1CharacterBaseBlock;
 		mosaic = bg1Mosaic;
-		winRegMask = 0x02;
 		break;
 	case 2:
-		if (!screenDisplayBg2) return;
 		xOffset = BG2HOFS;
 		yOffset = BG2VOFS;
 		screenSize = bg2ScreenSize;
 		bpp = bg2Bpp;
 		characterBaseBlock = bg2CharacterBaseBlock;
 		mosaic = bg2Mosaic;
-		winRegMask = 0x04;
 		break;
 	case 3:
-		if (!screenDisplayBg3) return;
 		xOffset = BG3HOFS;
 		yOffset = BG3VOFS;
 		screenSize = bg3ScreenSize;
 		bpp = bg3Bpp;
 		characterBaseBlock = bg3CharacterBaseBlock;
 		mosaic = bg3Mosaic;
-		winRegMask = 0x08;
 		break;
 	}
 
+	u16 *bgLine = bgLines[bgNum];
 	int paletteBank = 0;
-	bool verticalFlip = false;
 	bool horizontalFlip = false;
-	int tileIndex = 0;
-	int tileRowAddress = 0;
+	const u8 *tileRowData = nullptr;
+	int currentTile = -1;
 
 	int x = xOffset;
 	int mosX;
@@ -429,240 +814,387 @@ void GBAPPU::drawBgTile() {
 		y -= y % (bgMosV + 1);
 
 	for (int i = 0; i < 240; i++, x++) {
-		if ((mergedBuffer[i].layer != -1) && !mergedBuffer[i].semiTransparent && (blendMode != 1))
-			continue;
+		if (!mosaic && (((x & 7) == 0) || (i == 0))) { // Skip tiles the layers above cover
+			int count = std::min(8 - (x & 7), 240 - i);
+			if (pixelsCovered(i, count)) {
+				memset(&bgLine[i], 0, count * 2);
+				i += count - 1;
+				x += count - 1;
+				continue;
+			}
+		}
 
 		mosX = mosaic ? (x - (x % (bgMosH + 1))) : x;
 
-		{
+		if ((mosX >> 3) != currentTile) { // Only look at the tilemap once per tile
+			currentTile = mosX >> 3;
+
 			int tilemapIndex = (this->*tilemapIndexLUT[(bgNum * 4) + screenSize])(mosX, y);
 
 			u16 tilemapEntry = (vram[tilemapIndex + 1] << 8) | vram[tilemapIndex];
-			paletteBank = (tilemapEntry >> 8) & 0xF0;
-			verticalFlip = tilemapEntry & 0x0800;
+			paletteBank = bpp ? 0 : ((tilemapEntry >> 8) & 0xF0);
+			bool verticalFlip = tilemapEntry & 0x0800;
 			horizontalFlip = tilemapEntry & 0x0400;
-			tileIndex = tilemapEntry & 0x3FF;
+			int tileIndex = tilemapEntry & 0x3FF;
 
 			int yMod = verticalFlip ? (7 - (y % 8)) : (y % 8);
-			tileRowAddress = (characterBaseBlock * 0x4000) + (tileIndex * (32 << bpp)) + (yMod * (4 << bpp));
+			int tileRowAddress = (characterBaseBlock * 0x4000) + (tileIndex * (32 << bpp)) + (yMod * (4 << bpp));
+			tileRowData = (tileRowAddress < 0x10000) ? tileRow(tileRowAddress, bpp) : nullptr;
 		}
-		if (tileRowAddress >= 0x10000)
-			continue;
 
-		u8 tileData;
-		int xMod = horizontalFlip ? (7 - (mosX % 8)) : (mosX % 8);
-		if (bpp) { // 8 bits per pixel
-			tileData = vram[tileRowAddress + xMod];
-		} else { // 4 bits per pixel
-			tileData = vram[tileRowAddress + (xMod / 2)];
+		u8 tileData = 0;
+		if (tileRowData)
+			tileData = tileRowData[horizontalFlip ? (7 - (mosX & 7)) : (mosX & 7)];
 
-			if (xMod & 1) {
-				tileData >>= 4;
-			} else {
-				tileData &= 0xF;
-			}
-		}
+		bgLine[i] = tileData ? (paletteColors[paletteBank | tileData] | 0x8000) : 0;
+	}
+}
 
-		if (tileData) {
-			if (!(window0DisplayFlag || window1DisplayFlag || windowObjDisplayFlag) ||
-				((WININ & winRegMask) && win0Buffer[i]) ||
-				((WININ & (winRegMask << 8)) && win1Buffer[i]) ||
-				((WINOUT & (winRegMask << 8)) && winObjBuffer[i]) ||
-				((WINOUT & winRegMask) && winOutBuffer[i])) {
-				addPixel(i, paletteColors[(paletteBank * !bpp) | tileData], bgNum, false);
-			}
-		}
+// Texture coordinates of the next 8 pixels of an affine layer, kept separate so it can be vectorized
+static inline void affineCoordinates(int *texX, int *texY, i32 affX, i32 affY, int pa, int pc) {
+	for (int i = 0; i < 8; i++) {
+		texX[i] = (affX + (pa * i)) >> 8;
+		texY[i] = (affY + (pc * i)) >> 8;
 	}
 }
 
 template <int bgNum>
-void GBAPPU::drawBgAffine() {
+void GBAPPURenderer::drawBgAffine() {
 	int characterBaseBlock;
 	int screenBaseBlock;
 	bool wrapping;
 	unsigned int screenSize;
 	bool mosaic;
-	float affX;
-	float affY;
-	float pa;
-	float pc;
-	u16 winRegMask;
+	i32 affX;
+	i32 affY;
+	int pa;
+	int pc;
 	if (bgNum == 2) {
-		if (!screenDisplayBg2) return;
 		characterBaseBlock = bg2CharacterBaseBlock;
 		screenBaseBlock = bg2ScreenBaseBlock;
 		wrapping = bg2Wrapping;
 		screenSize = 128 << bg2ScreenSize;
-		mosaic = bg0Mosaic;
+		mosaic = bg2Mosaic;
 		affX = internalBG2X;
 		affY = internalBG2Y;
-		pa = (float)BG2PA / 256;
-		pc = (float)BG2PC / 256;
-		winRegMask = 0x04;
+		pa = BG2PA;
+		pc = BG2PC;
 	} else if (bgNum == 3) {
-		if (!screenDisplayBg3) return;
 		characterBaseBlock = bg3CharacterBaseBlock;
 		screenBaseBlock = bg3ScreenBaseBlock;
 		wrapping = bg3Wrapping;
 		screenSize = 128 << bg3ScreenSize;
-		mosaic = bg0Mosaic;
+		mosaic = bg3Mosaic;
 		affX = internalBG3X;
 		affY = internalBG3Y;
-		pa = (float)BG3PA / 256;
-		pc = (float)BG3PC / 256;
-		winRegMask = 0x08;
+		pa = BG3PA;
+		pc = BG3PC;
 	}
 
-	for (int i = 0; i < 240; i++, affX += pa, affY += pc) {
-		if ((mergedBuffer[i].layer != -1) && !mergedBuffer[i].semiTransparent && (blendMode != 1))
+	u16 *bgLine = bgLines[bgNum];
+	int texX[8];
+	int texY[8];
+	for (int i = 0; i < 240; i += 8, affX += pa * 8, affY += pc * 8) {
+		if (pixelsCovered(i, 8)) {
+			memset(&bgLine[i], 0, 16);
 			continue;
+		}
+		affineCoordinates(texX, texY, affX, affY, pa, pc);
 
-		int mosX = mosaic ? ((int)affX - ((int)affX % (bgMosH + 1))) : (int)affX;
-		int mosY = mosaic ? ((int)affY - ((int)affY % (bgMosV + 1))) : (int)affY;
-		if (!wrapping && (((unsigned int)mosY >= screenSize) || ((unsigned int)mosX >= screenSize)))
-			continue;
+		for (int j = 0; j < 8; j++) {
+			bgLine[i + j] = 0;
 
-		int tilemapIndex = (screenBaseBlock * 0x800) + (((mosY & (screenSize - 1)) / 8) * (screenSize / 8)) + ((mosX & (screenSize - 1)) / 8);
-		int tileAddress = (characterBaseBlock * 0x4000) + (vram[tilemapIndex] * 64) + ((mosY & 7) * 8) + (mosX & 7);
-		if (tileAddress >= 0x10000)
-			continue;
-		u8 tileData = vram[tileAddress];
-
-		if (tileData) {
-			if (!(window0DisplayFlag || window1DisplayFlag || windowObjDisplayFlag) ||
-				((WININ & winRegMask) && win0Buffer[i]) ||
-				((WININ & (winRegMask << 8)) && win1Buffer[i]) ||
-				((WINOUT & (winRegMask << 8)) && winObjBuffer[i]) ||
-				((WINOUT & winRegMask) && winOutBuffer[i])) {
-				addPixel(i, paletteColors[tileData], bgNum, false);
-			}
+			int mosX = mosaic ? (texX[j] - (texX[j] % (bgMosH + 1))) : texX[j];
+			int mosY = mosaic ? (texY[j] - (texY[j] % (bgMosV + 1))) : texY[j];
+			if (!wrapping && (((unsigned int)mosY >= screenSize) || ((unsigned int)mosX >= screenSize)))
+				continue;
+
+			int tilemapIndex = (screenBaseBlock * 0x800) + (((mosY & (screenSize - 1)) / 8) * (screenSize / 8)) + ((mosX & (screenSize - 1)) / 8);
+			int tileAddress = (characterBaseBlock * 0x4000) + (vram[tilemapIndex] * 64) + ((mosY & 7) * 8) + (mosX & 7);
+			if (tileAddress >= 0x10000)
+				continue;
+			u8 tileData = vram[tileAddress];
+
+			if (tileData)
+				bgLine[i + j] = paletteColors[tileData] | 0x8000;
 		}
 	}
 }
 
 template <int mode>
-void GBAPPU::drawBgBitmap() {
-	if (!screenDisplayBg2) return;
-	float affX = internalBG2X;
-	float affY = internalBG2Y;
-	float pa = (float)BG2PA / 256;
-	float pc = (float)BG2PC / 256;
-
-	for (int x = 0; x < 240; x++, affX += pa, affY += pc) {
-		if ((mergedBuffer[x].layer != -1) && !mergedBuffer[x].semiTransparent && (blendMode != 1))
-			continue;
+void GBAPPURenderer::drawBgBitmapRow(int startX, int y) {
+	constexpr int width = (mode == 5) ? 160 : 240;
+	constexpr int height = (mode == 5) ? 128 : 160;
 
-		int mosX = bg2Mosaic ? ((int)affX - ((int)affX % (bgMosH + 1))) : (int)affX;
-		int mosY = bg2Mosaic ? ((int)affY - ((int)affY % (bgMosV + 1))) : (int)affY;
+	u16 *bgLine = bgLines[2];
+	memset(bgLine, 0, sizeof(bgLines[2]));
+	if ((unsigned int)y >= height)
+		return;
 
-		u16 vramData;
-		if (mode == 3) {
-			if (!bg2Wrapping && (((unsigned int)mosY >= 160) || ((unsigned int)mosX >= 240)))
-				continue;
+	int first = std::max(0, -startX);
+	int last = std::min(240, width - startX);
+	if (first >= last)
+		return;
 
-			auto vramIndex = ((mosY * 240) + mosX) * 2;
-			vramData = (vram[vramIndex + 1] << 8) | vram[vramIndex];
-		} else if (mode == 4) {
-			if (!bg2Wrapping && (((unsigned int)mosY >= 160) || ((unsigned int)mosX >= 240)))
-				continue;
+	if (mode == 4) {
+		const u8 *row = &vram[(y * 240) + startX + (displayFrameSelect * 0xA000)];
+		for (int x = first; x < last; x++)
+			bgLine[x] = paletteColors[row[x]] | 0x8000;
+	} else {
+		u32 rowAddress = (((y * width) + startX) * 2) + ((mode == 5) ? (displayFrameSelect * 0xA000) : 0);
+		memcpy(&bgLine[first], &vram[rowAddress + (first * 2)], (last - first) * 2);
+		for (int x = first; x < last; x++)
+			bgLine[x] |= 0x8000;
+	}
+}
 
-			auto vramIndex = ((mosY * 240) + mosX) + (displayFrameSelect * 0xA000);
-			vramData = paletteColors[vram[vramIndex]];
-		} else if (mode == 5) {
-			if (!bg2Wrapping && (((unsigned int)mosY >= 128) || ((unsigned int)mosX >= 160)))
-				continue;
+// Bitmaps don't wrap around, so anything outside of them is transparent
+template <int mode>
+void GBAPPURenderer::drawBgBitmap() {
+	i32 affX = internalBG2X;
+	i32 affY = internalBG2Y;
+	int pa = BG2PA;
+	int pc = BG2PC;
+
+	u16 *bgLine = bgLines[2];
+	if ((pa == 0x100) && (pc == 0) && !bg2Mosaic) { // Unrotated bitmaps are just copied one row at a time
+		drawBgBitmapRow<mode>(affX >> 8, affY >> 8);
+		return;
+	}
+
+	int texX[8];
+	int texY[8];
+	for (int i = 0; i < 240; i += 8, affX += pa * 8, affY += pc * 8) {
+		affineCoordinates(texX, texY, affX, affY, pa, pc);
+
+		for (int j = 0; j < 8; j++) {
+			bgLine[i + j] = 0;
 
-			auto vramIndex = (((currentScanline * 160) + x) * 2) + (displayFrameSelect * 0xA000);
-			vramData = (vram[vramIndex + 1] << 8) | vram[vramIndex];
+			int mosX = bg2Mosaic ? (texX[j] - (texX[j] % (bgMosH + 1))) : texX[j];
+			int mosY = bg2Mosaic ? (texY[j] - (texY[j] % (bgMosV + 1))) : texY[j];
+
+			u16 vramData;
+			if (mode == 3) {
+				if (((unsigned int)mosY >= 160) || ((unsigned int)mosX >= 240))
+					continue;
+
+				auto vramIndex = ((mosY * 240) + mosX) * 2;
+				vramData = (vram[vramIndex + 1] << 8) | vram[vramIndex];
+			} else if (mode == 4) {
+				if (((unsigned int)mosY >= 160) || ((unsigned int)mosX >= 240))
+					continue;
+
+				auto vramIndex = ((mosY * 240) + mosX) + (displayFrameSelect * 0xA000);
+				vramData = paletteColors[vram[vramIndex]];
+			} else if (mode == 5) {
+				if (((unsigned int)mosY >= 128) || ((unsigned int)mosX >= 160))
+					continue;
+
+				auto vramIndex = (((mosY * 160) + mosX) * 2) + (displayFrameSelect * 0xA000);
+				vramData = (vram[vramIndex + 1] << 8) | vram[vramIndex];
+			}
+
+			bgLine[i + j] = vramData | 0x8000;
 		}
+	}
+}
+
+void GBAPPURenderer::drawBg(int bg) {
+	switch ((bgMode * 4) + bg) {
+	case (0 * 4) + 0: case (1 * 4) + 0: drawBgTile<0>(); break;
+	case (0 * 4) + 1: case (1 * 4) + 1: drawBgTile<1>(); break;
+	case (0 * 4) + 2: drawBgTile<2>(); break;
+	case (0 * 4) + 3: drawBgTile<3>(); break;
+	case (1 * 4) + 2: case (2 * 4) + 2: drawBgAffine<2>(); break;
+	case (2 * 4) + 3: drawBgAffine<3>(); break;
+	case (3 * 4) + 2: drawBgBitmap<3>(); break;
+	case (4 * 4) + 2: drawBgBitmap<4>(); break;
+	case (5 * 4) + 2: drawBgBitmap<5>(); break;
+	}
+}
+
+static void setPixelBits(u64 *bits, int start, int end) {
+	for (int word = start >> 6; word <= ((end - 1) >> 6); word++) {
+		int first = std::max(start - (word * 64), 0);
+		int last = std::min(end - (word * 64), 64);
+		bits[word] |= ((last == 64) ? ~0ULL : ((1ULL << last) - 1)) & ~((1ULL << first) - 1);
+	}
+}
+
+bool GBAPPURenderer::pixelsCovered(int start, int count) {
+	int word = start >> 6;
+	int bit = start & 63;
+	if ((bit + count) > 64)
+		return pixelsCovered(start, 64 - bit) && pixelsCovered((word + 1) << 6, count - (64 - bit));
+
+	u64 bits = (count == 64) ? ~0ULL : ((1ULL << count) - 1);
+	return ((coveredPixels[word] >> bit) & bits) == bits;
+}
+
+// A pixel is decided once two opaque layers are above it, or one that can't be alpha blended.
+// Objects are left out, which only makes this less eager.
+void GBAPPURenderer::updateCoverage(int bg, const u64 *visiblePixels, const u64 *effectPixels) {
+	bool alpha = (blendMode == 1) && (BLDCNT & (1 << bg));
+	for (int word = 0; word < 4; word++) {
+		u64 opaque = 0;
+		int count = std::min(64, 240 - (word * 64));
+		for (int i = 0; i < count; i++)
+			opaque |= (u64)(bgLines[bg][(word * 64) + i] >> 15) << i;
+		opaque &= visiblePixels[word];
+
+		coveredPixels[word] |= (opaque & opaquePixels[word]) | (opaque & ~(alpha ? effectPixels[word] : 0));
+		opaquePixels[word] |= opaque;
+	}
+}
 
-		if (!(window0DisplayFlag || window1DisplayFlag || windowObjDisplayFlag) ||
-			(win0Bg2Enable && win0Buffer[x]) ||
-			(win1Bg2Enable && win1Buffer[x]) ||
-			(winObjBg2Enable && winObjBuffer[x]) ||
-			(winOutBg2Enable && winOutBuffer[x])) {
-			addPixel(x, vramData, bg2Priority, false);
+// Picks the top two visible layers of every pixel and applies color effects to them
+void GBAPPURenderer::composite(u16 *line, const int *bgOrder, int bgCount) {
+	u16 backdrop = paletteColors[0] & 0x7FFF;
+	int bgPriorities[4] = {bg0Priority, bg1Priority, bg2Priority, bg3Priority};
+
+	for (int span = 0; span < windowSpanCount; span++) {
+		u8 mask = windowSpans[span].mask;
+		bool objVisible = mask & 0x10;
+		bool effects = mask & 0x20;
+		int visibleBgs[4];
+		int visibleBgCount = 0;
+		for (int i = 0; i < bgCount; i++) {
+			if (mask & (1 << bgOrder[i]))
+				visibleBgs[visibleBgCount++] = bgOrder[i];
 		}
+
+		for (int x = windowSpans[span].start; x < windowSpans[span].end; x++) {
+			u16 colors[2] = {backdrop, backdrop};
+			int layers[2] = {5, 5};
+			int found = 0;
+			bool semiTransparent = false;
+
+			bool objPending = objVisible && (objLine[x] & 0x8000);
+			int objPriority = objLineInfo[x] & 3;
+			for (int i = 0; (i < visibleBgCount) && (found < 2); i++) {
+				int bg = visibleBgs[i];
+				if (objPending && (objPriority <= bgPriorities[bg])) {
+					if (found == 0)
+						semiTransparent = objLineInfo[x] & 4;
+					colors[found] = objLine[x];
+					layers[found++] = 4;
+					objPending = false;
+					if (found == 2)
+						break;
+				}
+				if (bgLines[bg][x] & 0x8000) {
+					colors[found] = bgLines[bg][x];
+					layers[found++] = bg;
+				}
+			}
+			if (objPending && (found < 2)) {
+				if (found == 0)
+					semiTransparent = objLineInfo[x] & 4;
+				colors[found] = objLine[x];
+				layers[found++] = 4;
+			}
+
+			blendTop[x] = colors[0];
+			blendBottom[x] = colors[1];
+			blendEffect[x] = BLEND_NONE;
+			if (effects) {
+				bool firstTarget = BLDCNT & (1 << layers[0]);
+				bool secondTarget = BLDCNT & (0x100 << layers[1]);
+
+				if ((semiTransparent || ((blendMode == 1) && firstTarget)) && secondTarget) {
+					blendEffect[x] = BLEND_ALPHA;
+				} else if ((blendMode == 2) && firstTarget) {
+					blendEffect[x] = BLEND_BRIGHTEN;
+				} else if ((blendMode == 3) && firstTarget) {
+					blendEffect[x] = BLEND_DARKEN;
+				}
+			}
+		}
+	}
+
+	blendLine(line, blendTop, blendBottom, blendEffect, 240, std::min(16, (int)evaCoefficient), std::min(16, (int)evbCoefficient), std::min(16, (int)evyCoefficient));
+	for (int x = 0; x < 240; x++)
+		line[x] = convertColor(line[x]);
+}
+
+// Channels are scaled by 255/31 so that white stays white
+const std::array<u32, 0x8000> GBAPPU::rgba8888Lut = []() {
+	std::array<u32, 0x8000> lut{};
+	for (u32 color = 0; color < 0x8000; color++) {
+		u32 red = (((color & 0x1F) * 255) + 15) / 31;
+		u32 green = ((((color >> 5) & 0x1F) * 255) + 15) / 31;
+		u32 blue = ((((color >> 10) & 0x1F) * 255) + 15) / 31;
+		lut[color] = red | (green << 8) | (blue << 16) | (0xFF << 24);
 	}
+	return lut;
+}();
+
+void GBAPPURenderer::drawScanline(u32 *line) {
+	drawScanline(rgb555Line);
+	for (int i = 0; i < 240; i++)
+		line[i] = GBAPPU::rgba8888Lut[rgb555Line[i] & 0x7FFF];
 }
 
-void GBAPPU::drawScanline() {
+void GBAPPURenderer::drawScanline(u16 *line) {
 	if (forcedBlank) { // I honestly just wanted an excuse to make a mildly cursed for loop
-		for (int i = 0; i < 240; framebuffer[currentScanline][i++] = 0xFFFF);
+		for (int i = 0; i < 240; line[i++] = 0xFFFF);
 		return;
 	}
 
-	for (int i = 0; i < 240; i++) {
-		mergedBuffer[i].layer = -1;
-		mergedBuffer[i].semiTransparent = false;
-	}
 	calculateWindow();
 
-	switch (bgMode) {
-	case 0:
-		for (int layer = 0; layer < 4; layer++) {
-			drawObjects(layer);
-			if (bg0Priority == layer) drawBgTile<0>();
-			if (bg1Priority == layer) drawBgTile<1>();
-			if (bg2Priority == layer) drawBgTile<2>();
-			if (bg3Priority == layer) drawBgTile<3>();
+	// Layers that no window shows don't need to be drawn
+	u8 visibleLayers = 0;
+	for (int span = 0; span < windowSpanCount; span++)
+		visibleLayers |= windowSpans[span].mask;
+	if (visibleLayers & 0x10)
+		drawObjects(false);
+
+	// Backgrounds that exist in this mode, sorted by priority. Lower numbers win ties.
+	u8 modeLayers[8] = {0xF, 0x7, 0xC, 0x4, 0x4, 0x4, 0, 0};
+	u8 bgLayers = modeLayers[bgMode] & (DISPCNT >> 8) & visibleLayers;
+	int bgOrder[4];
+	int bgCount = 0;
+	int bgPriorities[4] = {bg0Priority, bg1Priority, bg2Priority, bg3Priority};
+	for (int priority = 0; priority < 4; priority++) {
+		for (int bg = 0; bg < 4; bg++) {
+			if ((bgLayers & (1 << bg)) && (bgPriorities[bg] == priority))
+				bgOrder[bgCount++] = bg;
 		}
-		break;
-	case 1:
-		for (int layer = 0; layer < 4; layer++) {
-			drawObjects(layer);
-			if (bg0Priority == layer) drawBgTile<0>();
-			if (bg1Priority == layer) drawBgTile<1>();
-			if (bg2Priority == layer) drawBgAffine<2>();
-		}
-		break;
-	case 2:
-		for (int layer = 0; layer < 4; layer++) {
-			drawObjects(layer);
-			if (bg2Priority == layer) drawBgAffine<2>();
-			if (bg3Priority == layer) drawBgAffine<3>();
-		}
-		break;
-	case 3:
-		for (int layer = 0; layer < 4; layer++) {
-			drawObjects(layer);
-			if (bg2Priority == layer) drawBgBitmap<3>();
-		}
-		break;
-	case 4:
-		for (int layer = 0; layer < 4; layer++) {
-			drawObjects(layer);
-			if (bg2Priority == layer) drawBgBitmap<4>();
-		}
-		break;
-	case 5:
-		for (int layer = 0; layer < 4; layer++) {
-			drawObjects(layer);
-			if (bg2Priority == layer) drawBgBitmap<5>();
+	}
+
+	// Pixels each layer is shown on and pixels with color effects
+	u64 windowPixels[6][4] = {};
+	for (int span = 0; span < windowSpanCount; span++) {
+		for (int layer = 0; layer < 6; layer++) {
+			if (windowSpans[span].mask & (1 << layer))
+				setPixelBits(windowPixels[layer], windowSpans[span].start, windowSpans[span].end);
 		}
-		break;
 	}
 
-	for (int i = 0; i < 240; i++) { // Copy scanline buffer to main framebuffer
-		if (mergedBuffer[i].layer == -1)
-			addPixel(i, paletteColors[0], 5, false);
-		framebuffer[currentScanline][i] = convertColor(mergedBuffer[i].color);
+	memset(opaquePixels, 0, sizeof(opaquePixels));
+	memset(coveredPixels, 0, sizeof(coveredPixels));
+	for (int i = 0; i < bgCount; i++) {
+		if ((coveredPixels[0] & coveredPixels[1] & coveredPixels[2]) == ~0ULL && (coveredPixels[3] == ((1ULL << 48) - 1))) {
+			bgCount = i; // Nothing below can be seen
+			break;
+		}
+
+		drawBg(bgOrder[i]);
+		if (i != (bgCount - 1))
+			updateCoverage(bgOrder[i], windowPixels[bgOrder[i]], windowPixels[5]);
 	}
+	composite(line, bgOrder, bgCount);
 
 	if (greenSwap) { // Convert BGRbgr pattern to BgRbGr
 		for (int i = 0; i < 240; i += 2) {
-			u16 left = framebuffer[currentScanline][i];
-			u16 right = framebuffer[currentScanline][i + 1];
+			u16 left = line[i];
+			u16 right = line[i + 1];
 
-			framebuffer[currentScanline][i] = (left & ~(0x1F << 5)) | (right & (0x1F << 5));
-			framebuffer[currentScanline][i + 1] = (right & ~(0x1F << 5)) | (left & (0x1F << 5));
+			line[i] = (left & ~(0x1F << 5)) | (right & (0x1F << 5));
+			line[i + 1] = (right & ~(0x1F << 5)) | (left & (0x1F << 5));
 		}
 	}
-
-	internalBG2X += (float)BG2PB / 256;
-	internalBG2Y += (float)BG2PD / 256;
-	internalBG3X += (float)BG3PB / 256;
-	internalBG3Y += (float)BG3PD / 256;
 }
 
 u8 GBAPPU::readIO(u32 address) {
@@ -721,6 +1253,8 @@ u8 GBAPPU::readIO(u32 address) {
 }
 
 void GBAPPU::writeIO(u32 address, u8 value) {
+	catchUp();
+
 	switch (address) {
 	case 0x4000000:
 		DISPCNT = (DISPCNT & 0xFF00) | (value & 0xF7);
@@ -835,35 +1369,35 @@ void GBAPPU::writeIO(u32 address, u8 value) {
 		break;
 	case 0x4000028:
 		BG2X = (BG2X & 0xFFFFFF00) | value;
-		internalBG2X = (float)((i32)(BG2X << 4) >> 4) / 256;
+		internalBG2X = (i32)(BG2X << 4) >> 4;
 		break;
 	case 0x4000029:
 		BG2X = (BG2X & 0xFFFF00FF) | (value << 8);
-		internalBG2X = (float)((i32)(BG2X << 4) >> 4) / 256;
+		internalBG2X = (i32)(BG2X << 4) >> 4;
 		break;
 	case 0x400002A:
 		BG2X = (BG2X & 0xFF00FFFF) | (value << 16);
-		internalBG2X = (float)((i32)(BG2X << 4) >> 4) / 256;
+		internalBG2X = (i32)(BG2X << 4) >> 4;
 		break;
 	case 0x400002B:
 		BG2X = (BG2X & 0x00FFFFFF) | ((value & 0x0F) << 24);
-		internalBG2X = (float)((i32)(BG2X << 4) >> 4) / 256;
+		internalBG2X = (i32)(BG2X << 4) >> 4;
 		break;
 	case 0x400002C:
 		BG2Y = (BG2Y & 0xFFFFFF00) | value;
-		internalBG2Y = (float)((i32)(BG2Y << 4) >> 4) / 256;
+		internalBG2Y = (i32)(BG2Y << 4) >> 4;
 		break;
 	case 0x400002D:
 		BG2Y = (BG2Y & 0xFFFF00FF) | (value << 8);
-		internalBG2Y = (float)((i32)(BG2Y << 4) >> 4) / 256;
+		internalBG2Y = (i32)(BG2Y << 4) >> 4;
 		break;
 	case 0x400002E:
 		BG2Y = (BG2Y & 0xFF00FFFF) | (value << 16);
-		internalBG2Y = (float)((i32)(BG2Y << 4) >> 4) / 256;
+		internalBG2Y = (i32)(BG2Y << 4) >> 4;
 		break;
 	case 0x400002F:
 		BG2Y = (BG2Y & 0x00FFFFFF) | ((value & 0x0F) << 24);
-		internalBG2Y = (float)((i32)(BG2Y << 4) >> 4) / 256;
+		internalBG2Y = (i32)(BG2Y << 4) >> 4;
 		break;
 	case 0x4000030:
 		BG3PA = (BG3PA & 0xFF00) | value;
@@ -891,35 +1425,35 @@ void GBAPPU::writeIO(u32 address, u8 value) {
 		break;
 	case 0x4000038:
 		BG3X = (BG3X & 0xFFFFFF00) | value;
-		internalBG3X = (float)((i32)(BG3X << 4) >> 4) / 256;
+		internalBG3X = (i32)(BG3X << 4) >> 4;
 		break;
 	case 0x4000039:
 		BG3X = (BG3X & 0xFFFF00FF) | (value << 8);
-		internalBG3X = (float)((i32)(BG3X << 4) >> 4) / 256;
+		internalBG3X = (i32)(BG3X << 4) >> 4;
 		break;
 	case 0x400003A:
 		BG3X = (BG3X & 0xFF00FFFF) | (value << 16);
-		internalBG3X = (float)((i32)(BG3X << 4) >> 4) / 256;
+		internalBG3X = (i32)(BG3X << 4) >> 4;
 		break;
 	case 0x400003B:
 		BG3X = (BG3X & 0x00FFFFFF) | ((value & 0x0F) << 24);
-		internalBG3X = (float)((i32)(BG3X << 4) >> 4) / 256;
+		internalBG3X = (i32)(BG3X << 4) >> 4;
 		break;
 	case 0x400003C:
 		BG3Y = (BG3Y & 0xFFFFFF00) | value;
-		internalBG3Y = (float)((i32)(BG3Y << 4) >> 4) / 256;
+		internalBG3Y = (i32)(BG3Y << 4) >> 4;
 		break;
 	case 0x400003D:
 		BG3Y = (BG3Y & 0xFFFF00FF) | (value << 8);
-		internalBG3Y = (float)((i32)(BG3Y << 4) >> 4) / 256;
+		internalBG3Y = (i32)(BG3Y << 4) >> 4;
 		break;
 	case 0x400003E:
 		BG3Y = (BG3Y & 0xFF00FFFF) | (value << 16);
-		internalBG3Y = (float)((i32)(BG3Y << 4) >> 4) / 256;
+		internalBG3Y = (i32)(BG3Y << 4) >> 4;
 		break;
 	case 0x400003F:
 		BG3Y = (BG3Y & 0x00FFFFFF) | ((value & 0x0F) << 24);
-		internalBG3Y = (float)((i32)(BG3Y << 4) >> 4) / 256;
+		internalBG3Y = (i32)(BG3Y << 4) >> 4;
 		break;
 	case 0x4000040:
 		WIN0H = (WIN0H & 0xFF00) | value;
@@ -971,15 +1505,12 @@ void GBAPPU::writeIO(u32 address, u8 value) {
 		break;
 	case 0x4000052:
 		BLDALPHA = (BLDALPHA & 0xFF00) | (value & 0x1F);
-		evaCoefficientFloat = (evaCoefficient & 0x10) ? 1 : (float)evaCoefficient / 16;
 		break;
 	case 0x4000053:
 		BLDALPHA = (BLDALPHA & 0x00FF) | ((value & 0x1F) << 8);
-		evbCoefficientFloat = (evbCoefficient & 0x10) ? 1 : (float)evbCoefficient / 16;
 		break;
 	case 0x4000054:
 		BLDY = value & 0x1F;
-		evyCoefficientFloat = (evyCoefficient & 0x10) ? 1 : (float)evyCoefficient / 16;
 		break;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include "savememory.hpp"
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SaveMemory::SaveMemory() {
+	buffer = nullptr;
+	bufferSize = 0;
+	fileDescriptor = -1;
+	mappedSize = 0;
+}
+
+SaveMemory::~SaveMemory() {
+	unmap();
+}
+
+void SaveMemory::resize(size_t newSize) {
+	if (mapped()) {
+		std::filesystem::path filePath = mappedFilePath;
+		unmap();
+
+		std::error_code error;
+		std::filesystem::resize_file(filePath, newSize, error);
+		if (!error && map(filePath, newSize))
+			return;
+
+		printf("Failed to resize save file mapping, falling back to memory\n");
+	}
+
+	storage.resize(newSize);
+	buffer = storage.data();
+	bufferSize = newSize;
+}
+
+// Maps the file (creating or extending it to newSize) in place of the buffer
+bool SaveMemory::map(std::filesystem::path filePath, size_t newSize) {
+	unmap();
+
+#ifndef _WIN32
+	int fd = open(filePath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		printf("Failed to open save file for mapping: %s\n", filePath.c_str());
+		return false;
+	}
+
+	struct stat fileStat;
+	if ((fstat(fd, &fileStat) != 0) || (((size_t)fileStat.st_size < newSize) && (ftruncate(fd, newSize) != 0))) {
+		printf("Failed to size save file for mapping: %s\n", filePath.c_str());
+		close(fd);
+		return false;
+	}
+
+	void *mapping = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		printf("Failed to map save file: %s\n", filePath.c_str());
+		close(fd);
+		return false;
+	}
+
+	storage.clear();
+	storage.shrink_to_fit();
+	buffer = (u8 *)mapping;
+	bufferSize = mappedSize = newSize;
+	fileDescriptor = fd;
+	mappedFilePath = filePath;
+	return true;
+#else
+	(void)filePath;
+	(void)newSize;
+	return false;
+#endif
+}
+
+// Goes back to a plain buffer holding the same contents
+void SaveMemory::unmap() {
+#ifndef _WIN32
+	if (!mapped())
+		return;
+
+	storage.assign(buffer, buffer + bufferSize);
+	munmap(buffer, mappedSize);
+	close(fileDescriptor);
+
+	buffer = storage.data();
+	fileDescriptor = -1;
+	mappedSize = 0;
+#endif
+}
+
+// Asks the kernel to start writing back the mapping, without waiting for it
+void SaveMemory::sync() {
+#ifndef _WIN32
+	if (mapped())
+		msync(buffer, mappedSize, MS_ASYNC);
+#endif
+}
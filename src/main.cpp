@@ -38,15 +38,24 @@ std::thread emuThread;
 // For fps counter
 int renderThreadFps = 0;
 int emuThreadFps = 0;
+int lineReusePercent = 0;
 u64 lastFpsPoll = 0;
 
+// Render loop pacing. Without vsync the UI is only redrawn when there is a new frame, an input event or
+// a debug view update, and never faster than the cap. sokol can't deliver events while frame() sleeps,
+// so it still redraws about once a display frame, and doesn't sleep at all while a widget is in use.
+bool vsyncEnabled = false;
+int uiFpsCap = 120; // 0 is uncapped
+int pendingUiFrames = 0;
+constexpr auto idleRedrawInterval = std::chrono::milliseconds(16);
+std::chrono::steady_clock::time_point lastPresent;
+
 // Sokol graphics
 constexpr auto GBA_WIDTH  = 240;
 constexpr auto GBA_HEIGHT = 160;
 
 sg_pass_action pass_action{};
 sg_image lcd_texture;
-uint32_t pixel_buffer[GBA_WIDTH * GBA_HEIGHT]; // For RGB565 -> RGB888 convert
 
 // ImGui Windows
 void mainMenuBar();
@@ -61,6 +70,8 @@ bool showSystemLog;
 void systemLogWindow();
 bool showMemEditor;
 void memEditorWindow();
+bool showBusStats;
+void busStatsWindow();
 #if BUILD_WITH_PPUDEBUG
 #include "ppudebug.hpp"
 #endif
@@ -95,9 +106,6 @@ void audioCallback(float* buffer, int num_frames, int num_channels);
 std::atomic<bool> quit = false;
 void loadRom();
 
-// RGB555A1 to RGBA8888
-u32 RGB5A1toRGBA8(u16 inRGB5A1);
-
 // sokol callbacks
 void init() {
     // Setup sokol
@@ -146,18 +154,24 @@ void init() {
 }
 
 void frame() {
-    // GBA emu main loop
-    if (GBA->ppu.updateScreen) {
-        for (int y = 0; y < GBA_HEIGHT; y++) {
-            for (int x = 0; x < GBA_WIDTH; x++) {
-                pixel_buffer[y * GBA_WIDTH + x] = RGB5A1toRGBA8(GBA->ppu.framebuffer[y][x]);
-            }
+    // Sleep until there's something new to draw
+    if (!vsyncEnabled) {
+        if (pendingUiFrames == 0) {
+            if (!ImGui::IsAnyItemActive())
+                GBA->ppu.waitForFrame(lastPresent + idleRedrawInterval);
+        } else {
+            pendingUiFrames--;
         }
+        if (uiFpsCap)
+            std::this_thread::sleep_until(lastPresent + std::chrono::microseconds(1000000 / uiFpsCap));
+        lastPresent = std::chrono::steady_clock::now();
+    }
 
+    // GBA emu main loop
+    if (const u32 *screen = GBA->ppu.takeFrame()) {
         sg_image_data image_data{};
-        image_data.subimage[0][0] = { .ptr=pixel_buffer, .size=(GBA_WIDTH * GBA_HEIGHT * sizeof(uint32_t)) };
+        image_data.subimage[0][0] = { .ptr=screen, .size=sizeof(GBA->ppu.presentBuffers[0]) };
         sg_update_image(lcd_texture, image_data);
-        GBA->ppu.updateScreen = false;
     }
 
     /* Draw ImGui Stuff */
@@ -180,6 +194,8 @@ void frame() {
         systemLogWindow();
     if (showMemEditor)
         memEditorWindow();
+    if (showBusStats)
+        busStatsWindow();
 #if BUILD_WITH_PPUDEBUG
     if (showLayerView)
         layerViewWindow();
@@ -197,6 +213,10 @@ void frame() {
         renderThreadFps = (int)io.Framerate;
         emuThreadFps = GBA->ppu.frameCounter;
         GBA->ppu.frameCounter = 0;
+
+        u64 hits = GBA->ppu.lineReuseHits.exchange(0);
+        u64 misses = GBA->ppu.lineReuseMisses.exchange(0);
+        lineReusePercent = (hits + misses) ? (int)((hits * 100) / (hits + misses)) : 0;
     }
 
     // Console Screen
@@ -205,6 +225,8 @@ void frame() {
 
         ImGui::Text("Rendering Thread:  %d FPS", renderThreadFps);
         ImGui::Text("Emulator Thread:   %d FPS", emuThreadFps);
+        if (GBA->ppu.lineReuseRequested)
+            ImGui::Text("Reused Scanlines:  %d%%", lineReusePercent);
         ImGui::Image((ImTextureID)(uintptr_t)lcd_texture.id, ImVec2(240 * 3, 160 * 3));
 
         ImGui::End();
@@ -221,6 +243,9 @@ void cleanup() {
     GBA->cpu.addThreadEvent(GBACPU::STOP, (u64)0);
 //    emuThread.detach();
 
+#if BUILD_WITH_PPUDEBUG
+    shutdownPpuDebug();
+#endif
     simgui_shutdown();
     saudio_shutdown();
     sg_shutdown();
@@ -228,6 +253,9 @@ void cleanup() {
 
 u16 currentJoypad = 0;
 void input(const sapp_event* event) {
+    // ImGui needs a second frame to settle after most events
+    pendingUiFrames = 2;
+
     // Joypad inputs
     if (event->type == SAPP_EVENTTYPE_KEY_DOWN) {
         for (int i = 0; i < 10; i++) {
@@ -272,6 +300,7 @@ int main(int __argc, char **__argv)
 #endif
 {
     GBA = new GameBoyAdvance();
+    GBA->ppu.outputFormat = GBAPPU::OUTPUT_RGBA8888;
     emuThread = std::thread(&GBACPU::run, std::ref(GBA->cpu));
 
 	// Parse arguments
@@ -296,6 +325,30 @@ int main(int __argc, char **__argv)
 			argBiosGiven = true;
 			argBiosFilePath = __argv[i];
 			break;
+		case cexprHash("--map-save"):
+			GBA->mapSaveFile = true;
+			break;
+		case cexprHash("--frameskip"):
+			if (__argc == ++i) {
+				printf("Not enough arguments for flag --frameskip\n");
+				return -1;
+			}
+			if (!strcmp(__argv[i], "auto")) {
+				GBA->ppu.autoFrameskip = true;
+			} else {
+				GBA->ppu.frameskip = std::clamp(atoi(__argv[i]), 0, GBAPPU::maxFrameskip);
+			}
+			break;
+		case cexprHash("--vsync"):
+			vsyncEnabled = true;
+			break;
+		case cexprHash("--fps-cap"):
+			if (__argc == ++i) {
+				printf("Not enough arguments for flag --fps-cap\n");
+				return -1;
+			}
+			uiFpsCap = std::max(atoi(__argv[i]), 0);
+			break;
 		default:
 			if (i == 1) {
 				argRomGiven = true;
@@ -327,12 +380,15 @@ int main(int __argc, char **__argv)
     std::string windowName = "gbaemu.cpp - ";
     windowName += argRomFilePath.string();
     desc.window_title = windowName.c_str();
-    desc.swap_interval = 0;
+    desc.swap_interval = vsyncEnabled ? 1 : 0;
     desc.icon.sokol_default = true,
     desc.logger.func = slog_func;
     sapp_run(desc);
 
-    GBA->save();
+    // cleanup() stopped the emulator, which puts its last save writes in the snapshot
+    for (int i = 0; (i < 100) && GBA->cpu.running; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    GBA->flushSave();
     emuThread.detach();
 
 	return 0;
@@ -354,6 +410,7 @@ void audioCallback(float* buffer, int num_frames, int num_channels) {
 	GBA->apu.sampleBufferIndex = 0;
 	GBA->apu.apuBlock = false;
 	GBA->apu.sampleBufferMutex.unlock();
+	GBA->cpu.wakeThread();
 }
 
 void loadRom() {
@@ -402,6 +459,34 @@ void mainMenuBar() {
 		}
 
 		ImGui::Separator();
+		if (ImGui::MenuItem("Render on Separate Thread", nullptr, GBA->ppu.renderThreadRequested.load()))
+			GBA->ppu.renderThreadRequested = !GBA->ppu.renderThreadRequested;
+		if (ImGui::MenuItem("Reuse Unchanged Scanlines", nullptr, GBA->ppu.lineReuseRequested.load()))
+			GBA->ppu.lineReuseRequested = !GBA->ppu.lineReuseRequested;
+		if (ImGui::MenuItem("Catch-up Rendering", nullptr, GBA->ppu.catchUpRequested.load()))
+			GBA->ppu.catchUpRequested = !GBA->ppu.catchUpRequested;
+		if (ImGui::BeginMenu("Frameskip")) {
+			ImGui::MenuItem("Auto", nullptr, &GBA->ppu.autoFrameskip);
+			ImGui::Separator();
+			for (int i = 0; i <= GBAPPU::maxFrameskip; i++) {
+				if (ImGui::MenuItem(std::to_string(i).c_str(), nullptr, !GBA->ppu.autoFrameskip && (GBA->ppu.frameskip == i))) {
+					GBA->ppu.autoFrameskip = false;
+					GBA->ppu.frameskip = i;
+				}
+			}
+
+			ImGui::EndMenu();
+		}
+		if (ImGui::BeginMenu("UI Frame Cap", !vsyncEnabled)) {
+			for (int cap : {30, 60, 120, 144, 240}) {
+				if (ImGui::MenuItem(std::to_string(cap).c_str(), nullptr, uiFpsCap == cap))
+					uiFpsCap = cap;
+			}
+			if (ImGui::MenuItem("Uncapped", nullptr, uiFpsCap == 0))
+				uiFpsCap = 0;
+
+			ImGui::EndMenu();
+		}
 		if (ImGui::BeginMenu("Audio Channels")) {
 			ImGui::MenuItem("Channel 1", nullptr, &GBA->apu.ch1OverrideEnable);
 			ImGui::MenuItem("Channel 2", nullptr, &GBA->apu.ch2OverrideEnable);
@@ -420,6 +505,7 @@ void mainMenuBar() {
 		ImGui::MenuItem("Debug CPU", nullptr, &showCpuDebug);
 		ImGui::MenuItem("System Log", nullptr, &showSystemLog);
 		ImGui::MenuItem("Memory Editor", nullptr, &showMemEditor);
+		ImGui::MenuItem("Bus", nullptr, &showBusStats);
 #if BUILD_WITH_PPUDEBUG
 		ImGui::MenuItem("Inspect Layers", nullptr, &showLayerView);
 		ImGui::MenuItem("View Tiles", nullptr, &showTiles);
@@ -595,6 +681,55 @@ void systemLogWindow() {
 	ImGui::End();
 }
 
+void busStatsWindow() {
+	ImGui::Begin("Bus", &showBusStats);
+
+	bool collectStats = GBA->busStatsEnabled;
+	if (ImGui::Checkbox("Collect Statistics", &collectStats))
+		GBA->cpu.addThreadEvent(GBACPU::SET_BUS_STATS, (u64)collectStats);
+
+	GameBoyAdvance::BusStats stats[GameBoyAdvance::BUS_REGION_COUNT];
+	u64 frameCycles;
+	{
+		std::lock_guard<std::mutex> lock(GBA->busStatsMutex);
+		memcpy(stats, GBA->busStatsLastFrame, sizeof(stats));
+		frameCycles = GBA->busStatsLastFrameCycles;
+	}
+
+	u64 totalCycles = 0;
+	if (ImGui::BeginTable("busStats", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+		ImGui::TableSetupColumn("Region");
+		ImGui::TableSetupColumn("Accesses");
+		ImGui::TableSetupColumn("Bytes");
+		ImGui::TableSetupColumn("Cycles");
+		ImGui::TableSetupColumn("Prefetch Saved");
+		ImGui::TableHeadersRow();
+
+		for (int i = 0; i < GameBoyAdvance::BUS_REGION_COUNT; i++) {
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(GameBoyAdvance::busRegionNames[i]);
+			ImGui::TableNextColumn();
+			ImGui::Text("%llu", (unsigned long long)stats[i].accesses);
+			ImGui::TableNextColumn();
+			ImGui::Text("%llu", (unsigned long long)stats[i].bytes);
+			ImGui::TableNextColumn();
+			ImGui::Text("%llu", (unsigned long long)stats[i].cycles);
+			ImGui::TableNextColumn();
+			ImGui::Text("%llu", (unsigned long long)stats[i].prefetchSavedCycles);
+
+			totalCycles += stats[i].cycles;
+		}
+		ImGui::EndTable();
+	}
+
+	ImGui::Text("Bus Cycles:  %llu / %llu", (unsigned long long)totalCycles, (unsigned long long)frameCycles);
+	if (ImGui::Button("Copy Report"))
+		ImGui::SetClipboardText(GBA->busStatsReport().c_str());
+
+	ImGui::End();
+}
+
 void romFileDialog() {
 	nfdfilteritem_t filter[1] = {{"Game Boy Advance ROM", "gba,bin"}};
 	NFD::UniquePath nfdRomFilePath;
@@ -686,10 +821,3 @@ bool memEditorHighlight(const ImU8* data, size_t off) {
 		return false;
 	}
 }
-
-u32 RGB5A1toRGBA8(u16 inRGB5A1) {
-    u8 r = u8(float((inRGB5A1 & 0b0000000000011111) >> 0U)  / 32.0f * 255.0);
-    u8 g = u8(float((inRGB5A1 & 0b0000001111100000) >> 5U)  / 32.0f * 255.0);
-    u8 b = u8(float((inRGB5A1 & 0b0111110000000000) >> 10U) / 32.0f * 255.0);
-    return r | g << 8 | b << 16 | 0xFF << 24;
-}
@@ -5,22 +5,38 @@
 #include "sokol_gfx.h"
 #include "util/sokol_imgui.h"
 
-u32 _RGB5A1toRGBA8(u16 inRGB5A1) {
-    u8 r = u8(float((inRGB5A1 & 0b0000000000011111) >> 0U)  / 32.0f * 255.0);
-    u8 g = u8(float((inRGB5A1 & 0b0000001111100000) >> 5U)  / 32.0f * 255.0);
-    u8 b = u8(float((inRGB5A1 & 0b0111110000000000) >> 10U) / 32.0f * 255.0);
-    return r | g << 8 | b << 16 | 0xFF << 24;
-}
-
 u32 convertColor(u16 x) {
-    u16 tmp = (x | 0x8000);
-    return _RGB5A1toRGBA8(tmp);
+    return GBAPPU::rgba8888Lut[x & 0x7FFF];
 }
 
 sg_image debugTexture;
-u32 debugBuffer[512 * 512];
+u32 debugBuffers[2][512 * 512];
 sg_image debugTilesTexture;
-u32 debugTilesBuffer[256 * 512];
+u32 debugTilesBuffers[2][256 * 512];
+
+// The layer and tile views are drawn on a worker thread from GBAPPU::debugSnapshot, and only when
+// the snapshot or the view's settings changed. Finished images are swapped with the front buffer,
+// which the UI uploads only when it holds a new image.
+struct DebugView {
+	bool requested; // Set by the UI every frame the window is open
+	int settings;
+	int renderedSettings;
+	u64 renderedGeneration;
+	u32 *back;
+	u32 *front;
+	int frontXSize;
+	int frontYSize;
+	u64 frontVersion;
+	u64 uploadedVersion;
+};
+DebugView layerView = {false, 0, -1, 0, debugBuffers[0], debugBuffers[1], 0, 0, 0, 0};
+DebugView tilesView = {false, 0, -1, 0, debugTilesBuffers[0], debugTilesBuffers[1], 256, 512, 0, 0};
+std::thread debugViewThread;
+std::mutex debugViewMutex;
+std::condition_variable debugViewCondition;
+bool debugViewExit = false;
+void drawDebugTiles(bool highColor, int palette, u32 *buffer);
+void debugViewLoop();
 
 void initPpuDebug() {
 	// Create image for debug display
@@ -41,6 +57,17 @@ void initPpuDebug() {
     img_desc.height = 512;
 
     debugTilesTexture = sg_make_image(&img_desc);
+
+	debugViewThread = std::thread(debugViewLoop);
+}
+
+void shutdownPpuDebug() {
+	{
+		std::lock_guard<std::mutex> lock(debugViewMutex);
+		debugViewExit = true;
+	}
+	debugViewCondition.notify_one();
+	debugViewThread.join();
 }
 
 enum bgLayer {
@@ -78,10 +105,10 @@ template <int bgNum, int size>
 int calculateTilemapIndex(int x, int y) {
 	int baseBlock;
 	switch (bgNum) {
-	case 0: baseBlock = GBA->ppu.bg0ScreenBaseBlock; break;
-	case 1: baseBlock = GBA->ppu.bg1ScreenBaseBlock; break;
-	case 2: baseBlock = GBA->ppu.bg2ScreenBaseBlock; break;
-	case 3: baseBlock = GBA->ppu.bg3ScreenBaseBlock; break;
+	case 0: baseBlock = GBA->ppu.debugSnapshot.state.bg0ScreenBaseBlock; break;
+	case 1: baseBlock = GBA->ppu.debugSnapshot.state.bg1ScreenBaseBlock; break;
+	case 2: baseBlock = GBA->ppu.debugSnapshot.state.bg2ScreenBaseBlock; break;
+	case 3: baseBlock = GBA->ppu.debugSnapshot.state.bg3ScreenBaseBlock; break;
 	}
 
 	int offset;
@@ -120,8 +147,9 @@ constexpr int (*tilemapIndexLUTDebug[])(int, int) = {
 int screenXSize;
 int screenYSize;
 void drawDebugLayer(bgLayer type, u32 *buffer) {
-	screenXSize = layerInfo[currentlySelectedLayer].xSize;
-	screenYSize = layerInfo[currentlySelectedLayer].ySize;
+	const GBAPPU::DebugSnapshot& snapshot = GBA->ppu.debugSnapshot;
+	screenXSize = layerInfo[type].xSize;
+	screenYSize = layerInfo[type].ySize;
 	switch (type) {
 	case BG0_REGULAR: // Shamefully copied from the PPU
 	case BG1_REGULAR:
@@ -132,24 +160,24 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 		int characterBaseBlock;
 		switch (type) {
 		case BG0_REGULAR:
-			screenSize = GBA->ppu.bg0ScreenSize;
-			bpp = GBA->ppu.bg0Bpp;
-			characterBaseBlock = GBA->ppu.bg0CharacterBaseBlock;
+			screenSize = snapshot.state.bg0ScreenSize;
+			bpp = snapshot.state.bg0Bpp;
+			characterBaseBlock = snapshot.state.bg0CharacterBaseBlock;
 			break;
 		case BG1_REGULAR:
-			screenSize = GBA->ppu.bg1ScreenSize;
-			bpp = GBA->ppu.bg1Bpp;
-			characterBaseBlock = GBA->ppu.bg1CharacterBaseBlock;
+			screenSize = snapshot.state.bg1ScreenSize;
+			bpp = snapshot.state.bg1Bpp;
+			characterBaseBlock = snapshot.state.bg1CharacterBaseBlock;
 			break;
 		case BG2_REGULAR:
-			screenSize = GBA->ppu.bg2ScreenSize;
-			bpp = GBA->ppu.bg2Bpp;
-			characterBaseBlock = GBA->ppu.bg2CharacterBaseBlock;
+			screenSize = snapshot.state.bg2ScreenSize;
+			bpp = snapshot.state.bg2Bpp;
+			characterBaseBlock = snapshot.state.bg2CharacterBaseBlock;
 			break;
 		case BG3_REGULAR:
-			screenSize = GBA->ppu.bg3ScreenSize;
-			bpp = GBA->ppu.bg3Bpp;
-			characterBaseBlock = GBA->ppu.bg3CharacterBaseBlock;
+			screenSize = snapshot.state.bg3ScreenSize;
+			bpp = snapshot.state.bg3Bpp;
+			characterBaseBlock = snapshot.state.bg3CharacterBaseBlock;
 			break;
 		default: // Get the compiler to shut up
 			screenSize = 0;
@@ -172,7 +200,7 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 				if ((x % 8) == 0) { // Fetch new tile
 					int tilemapIndex = (*tilemapIndexLUTDebug[(type * 4) + screenSize])(x, y);
 
-					u16 tilemapEntry = (GBA->ppu.vram[tilemapIndex + 1] << 8) | GBA->ppu.vram[tilemapIndex];
+					u16 tilemapEntry = (snapshot.vram[tilemapIndex + 1] << 8) | snapshot.vram[tilemapIndex];
 					paletteBank = (tilemapEntry >> 8) & 0xF0;
 					verticalFlip = tilemapEntry & 0x0800;
 					horizontalFlip = tilemapEntry & 0x0400;
@@ -185,9 +213,9 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 				u8 tileData;
 				int xMod = horizontalFlip ? (7 - (x % 8)) : (x % 8);
 				if (bpp) { // 8 bits per pixel
-					tileData = GBA->ppu.vram[tileRowAddress + xMod];
+					tileData = snapshot.vram[tileRowAddress + xMod];
 				} else { // 4 bits per pixel
-					tileData = GBA->ppu.vram[tileRowAddress + (xMod / 2)];
+					tileData = snapshot.vram[tileRowAddress + (xMod / 2)];
 
 					if (xMod & 1) {
 						tileData >>= 4;
@@ -196,9 +224,9 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 					}
 				}
 				if (tileData != 0) {
-					debugBuffer[(y * screenXSize) + x] = convertColor(GBA->ppu.paletteColors[(paletteBank * !bpp) | tileData]);
+					buffer[(y * screenXSize) + x] = snapshot.paletteRgba[(paletteBank * !bpp) | tileData];
 				} else {
-					debugBuffer[(y * screenXSize) + x] = convertColor(GBA->ppu.paletteColors[0]);
+					buffer[(y * screenXSize) + x] = snapshot.paletteRgba[0];
 				}
 			}
 		}
@@ -207,7 +235,7 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 		for (int line = 0; line < 160; line++) {
 			for (int x = 0; x < 240; x++) {
 				auto vramIndex = ((line * 240) + x) * 2;
-				u16 vramData = (GBA->ppu.vram[vramIndex + 1] << 8) | GBA->ppu.vram[vramIndex];
+				u16 vramData = (snapshot.vram[vramIndex + 1] << 8) | snapshot.vram[vramIndex];
 				buffer[(line * 240) + x] = convertColor(vramData);
 			}
 		}
@@ -217,8 +245,8 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 		for (int line = 0; line < 160; line++) {
 			for (int x = 0; x < 240; x++) {
 				auto vramIndex = (line * 240) + x + ((type == MODE4_BG2_FLIPPED) * 0xA000);
-				u8 vramData = GBA->ppu.vram[vramIndex];
-				buffer[(line * 240) + x] = convertColor(GBA->ppu.paletteColors[vramData]);
+				u8 vramData = snapshot.vram[vramIndex];
+				buffer[(line * 240) + x] = snapshot.paletteRgba[vramData];
 			}
 		}
 		break;
@@ -227,7 +255,7 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 		for (int line = 0; line < 128; line++) {
 			for (int x = 0; x < 160; x++) {
 				auto vramIndex = (((line * 160) + x) * 2) + ((type == MODE5_BG2_FLIPPED) * 0xA000);
-				u16 vramData = (GBA->ppu.vram[vramIndex + 1] << 8) | GBA->ppu.vram[vramIndex];
+				u16 vramData = (snapshot.vram[vramIndex + 1] << 8) | snapshot.vram[vramIndex];
 				buffer[(line * 160) + x] = convertColor(vramData);
 			}
 		}
@@ -235,6 +263,55 @@ void drawDebugLayer(bgLayer type, u32 *buffer) {
 	}
 }
 
+static bool debugViewOutdated(const DebugView& view, u64 generation) {
+	return view.requested && ((view.settings != view.renderedSettings) || (generation != view.renderedGeneration));
+}
+
+void debugViewLoop() {
+	std::unique_lock<std::mutex> lock(debugViewMutex);
+	while (true) {
+		debugViewCondition.wait(lock, [&]{
+			u64 generation = GBA->ppu.debugSnapshotGeneration;
+			return debugViewOutdated(layerView, generation) || debugViewOutdated(tilesView, generation) || debugViewExit;
+		});
+		if (debugViewExit)
+			return;
+		bool drawLayer = layerView.requested;
+		bool drawTiles = tilesView.requested;
+		int layerSettings = layerView.settings;
+		int tilesSettings = tilesView.settings;
+		layerView.requested = tilesView.requested = false;
+		lock.unlock();
+
+		u64 generation;
+		{
+			std::lock_guard<std::mutex> snapshotLock(GBA->ppu.debugSnapshotMutex);
+			generation = GBA->ppu.debugSnapshotGeneration;
+			if (drawLayer)
+				drawDebugLayer(layerInfo[layerSettings].enumValue, layerView.back);
+			if (drawTiles)
+				drawDebugTiles(tilesSettings == 0x200, tilesSettings & 0x1FF, tilesView.back);
+		}
+
+		lock.lock();
+		if (drawLayer) {
+			std::swap(layerView.back, layerView.front);
+			layerView.frontXSize = screenXSize;
+			layerView.frontYSize = screenYSize;
+			layerView.frontVersion++;
+			layerView.renderedSettings = layerSettings;
+			layerView.renderedGeneration = generation;
+		}
+		if (drawTiles) {
+			std::swap(tilesView.back, tilesView.front);
+			tilesView.frontVersion++;
+			tilesView.renderedSettings = tilesSettings;
+			tilesView.renderedGeneration = generation;
+		}
+		GBA->ppu.wakePresenter(); // Show the new image without waiting for the next frame
+	}
+}
+
 bool showLayerView;
 void layerViewWindow() {
 	ImGui::Begin("Layer View", &showLayerView);
@@ -257,18 +334,58 @@ void layerViewWindow() {
 		ImGui::Text("[%02X.%02X, %02X.%02X]\n[%02X.%02X, %02X.%02X]", GBA->ppu.BG2PA >> 8, GBA->ppu.BG2PA & 0xFF, GBA->ppu.BG2PB >> 8, GBA->ppu.BG2PB & 0xFF, GBA->ppu.BG2PC >> 8, GBA->ppu.BG2PC & 0xFF, GBA->ppu.BG2PD >> 8, GBA->ppu.BG2PD & 0xFF);
 	}
 
-	drawDebugLayer(layerInfo[currentlySelectedLayer].enumValue, debugBuffer);
-//	glBindTexture(GL_TEXTURE_2D, debugTexture);
-//	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB5_A1, screenXSize, screenYSize, 0, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, debugBuffer);
-    sg_image_data image_data{};
-//    image_data.subimage[0][0] = { .ptr=debugBuffer, .size=(screenXSize * screenYSize * sizeof(uint32_t)) };
-    image_data.subimage[0][0] = { .ptr=debugBuffer, .size=(512 * 512 * sizeof(uint32_t)) };
-    sg_update_image(debugTexture, image_data);
-	ImGui::Image((void*)(intptr_t)debugTexture.id, ImVec2(screenXSize * 2, screenYSize * 2));
+	int xSize;
+	int ySize;
+	{
+		std::lock_guard<std::mutex> lock(debugViewMutex);
+		layerView.requested = true;
+		layerView.settings = currentlySelectedLayer;
+		if (layerView.frontVersion != layerView.uploadedVersion) {
+			sg_image_data image_data{};
+			image_data.subimage[0][0] = { .ptr=layerView.front, .size=(512 * 512 * sizeof(uint32_t)) };
+			sg_update_image(debugTexture, image_data);
+			layerView.uploadedVersion = layerView.frontVersion;
+		}
+		xSize = layerView.frontXSize;
+		ySize = layerView.frontYSize;
+	}
+	GBA->ppu.requestDebugSnapshot();
+	debugViewCondition.notify_one();
+
+	ImGui::Image((void*)(intptr_t)debugTexture.id, ImVec2(xSize * 2, ySize * 2));
 
 	ImGui::End();
 }
 
+void drawDebugTiles(bool highColor, int palette, u32 *buffer) {
+	const GBAPPU::DebugSnapshot& snapshot = GBA->ppu.debugSnapshot;
+	if (highColor) {
+		for (int y = 0; y < 256; y++) {
+			for (int x = 0; x < (256 / 8); x++) {
+				int tileRowAddress = ((x + ((y / 8) * 32)) * 64) + ((y % 8) * 4);
+
+				for (int subX = 0; subX < 8; subX++)
+					buffer[(y * 256) + (x * 8) + subX] = snapshot.paletteRgba[snapshot.vram[tileRowAddress + subX]];
+			}
+		}
+	} else {
+		for (int y = 0; y < 512; y++) {
+			for (int x = 0; x < (256 / 8); x++) {
+				int tileRowAddress = ((x + ((y / 8) * 32)) * 32) + ((y % 8) * 4);
+
+				buffer[(y * 256) + (x * 8) + 0] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 0] & 0xF)];
+				buffer[(y * 256) + (x * 8) + 1] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 0] >> 4)];
+				buffer[(y * 256) + (x * 8) + 2] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 1] & 0xF)];
+				buffer[(y * 256) + (x * 8) + 3] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 1] >> 4)];
+				buffer[(y * 256) + (x * 8) + 4] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 2] & 0xF)];
+				buffer[(y * 256) + (x * 8) + 5] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 2] >> 4)];
+				buffer[(y * 256) + (x * 8) + 6] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 3] & 0xF)];
+				buffer[(y * 256) + (x * 8) + 7] = snapshot.paletteRgba[palette | (snapshot.vram[tileRowAddress + 3] >> 4)];
+			}
+		}
+	}
+}
+
 bool highColor;
 int selectedPalette;
 
@@ -290,48 +407,25 @@ void tilesWindow() {
 		}
 	}
 
-	if (highColor) {
-		for (int y = 0; y < 256; y++) {
-			for (int x = 0; x < (256 / 8); x++) {
-				int tileRowAddress = ((x + ((y / 8) * 32)) * 64) + ((y % 8) * 4);
-
-				for (int subX = 0; subX < 8; subX++)
-					debugTilesBuffer[(y * 256) + (x * 8) + subX] = convertColor(GBA->ppu.paletteColors[GBA->ppu.vram[tileRowAddress + subX]]);
-			}
-		}
-	} else {
-		for (int y = 0; y < 512; y++) {
-			for (int x = 0; x < (256 / 8); x++) {
-				int tileRowAddress = ((x + ((y / 8) * 32)) * 32) + ((y % 8) * 4);
-
-				debugTilesBuffer[(y * 256) + (x * 8) + 0] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 0] & 0xF)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 1] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 0] >> 4)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 2] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 1] & 0xF)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 3] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 1] >> 4)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 4] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 2] & 0xF)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 5] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 2] >> 4)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 6] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 3] & 0xF)]);
-				debugTilesBuffer[(y * 256) + (x * 8) + 7] = convertColor(GBA->ppu.paletteColors[selectedPalette | (GBA->ppu.vram[tileRowAddress + 3] >> 4)]);
-			}
+	{
+		std::lock_guard<std::mutex> lock(debugViewMutex);
+		tilesView.requested = true;
+		tilesView.settings = highColor ? 0x200 : selectedPalette;
+		if (tilesView.frontVersion != tilesView.uploadedVersion) {
+			sg_image_data image_data{};
+			image_data.subimage[0][0] = { .ptr=tilesView.front, .size=(256 * 512 * sizeof(uint32_t)) };
+			sg_update_image(debugTilesTexture, image_data);
+			tilesView.uploadedVersion = tilesView.frontVersion;
 		}
 	}
+	GBA->ppu.requestDebugSnapshot();
+	debugViewCondition.notify_one();
 
-//	glBindTexture(GL_TEXTURE_2D, debugTexture);
-//	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB5_A1, 256, highColor ? 256 : 512, 0, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, debugTilesBuffer);
-    sg_image_data image_data{};
-//    image_data.subimage[0][0] = { .ptr=debugTilesBuffer, .size=(256 * (highColor ? 256 : 512) * sizeof(uint32_t)) };
-    image_data.subimage[0][0] = { .ptr=debugTilesBuffer, .size=(256 * 512 * sizeof(uint32_t)) };
-    sg_update_image(debugTilesTexture, image_data);
 	ImGui::Image((void*)(intptr_t)debugTilesTexture.id, ImVec2(256 * 2, highColor ? 256 : 512 * 2));
 
 	ImGui::End();
 }
 
-#define color555to8888(x) \
-	(((int)(((((x) & 0x7C00) >> 10) / (float)31) * 255) << 8) | \
-	((int)(((((x) & 0x03E0) >> 5) / (float)31) * 255) << 16) | \
-	((int)((((x) & 0x001F) / (float)31) * 255) << 24) | 0xFF)
-
 bool showPalette;
 void paletteWindow() {
 	static int selectedIndex;
@@ -358,8 +452,7 @@ void paletteWindow() {
 		for (int x = 0; x < 16; x++) {
 			int index = (y * 16) + x;
 			std::string id = "Color " + std::to_string(index);
-			u32 color = color555to8888(GBA->ppu.paletteColors[index]);
-			ImVec4 colorVec = ImVec4((color >> 24) / 255.0f, ((color >> 16) & 0xFF) / 255.0f, ((color >> 8) & 0xFF) / 255.0f, (color & 0xFF) / 255.0f);
+			ImVec4 colorVec = ImGui::ColorConvertU32ToFloat4(GBA->ppu.paletteRgba[index]);
 
 			if (ImGui::ColorButton(id.c_str(), colorVec, (selectedIndex == index) ? 0 : ImGuiColorEditFlags_NoBorder, ImVec2(10, 10)))
 				selectedIndex = index;
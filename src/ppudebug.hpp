@@ -10,6 +10,7 @@
 extern GameBoyAdvance* GBA;
 
 void initPpuDebug();
+void shutdownPpuDebug();
 
 extern bool showLayerView;
 void layerViewWindow();